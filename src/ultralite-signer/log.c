@@ -15,16 +15,20 @@
 #include <stdarg.h>
 #include <stdio.h>
 
-/* WARNING: These functions are NOT thread-safe. */
+/* Each message is written with a single stdio call, so messages of
+   concurrent threads don't mix. */
 
 #define ERR_TIMESTAMP "0000-00-00T00:00:00.000+00:00"
-static char timestamp[64];
+#define TIMESTAMP_SIZE 64
+#define LINE_SIZE 1024
 
 #ifdef _WIN32
 #include <stdlib.h>
 #include <time.h>
 #include <windows.h>
 #define getpid GetCurrentThreadId
+#define snprintf _snprintf
+#define vsnprintf _vsnprintf
 long long unix_base;
 static void init_unix_base()
 {
@@ -35,7 +39,7 @@ static void init_unix_base()
 	st.wDay = 1;
 	SystemTimeToFileTime(&st, (FILETIME*)&unix_base);
 }
-const char* GetTimestamp()
+const char* GetTimestamp(char timestamp[TIMESTAMP_SIZE])
 {
 	int n, err;
 	long long nowft;
@@ -61,15 +65,15 @@ const char* GetTimestamp()
 	n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
 	if (n == 0)
 		return ERR_TIMESTAMP;
-	n = _snprintf(timestamp, sizeof(timestamp), "%s.%03d%+03d:%02d", strf, millis, -gmtoff / 3600, abs(gmtoff) % 3600 / 60);
-	if (n < 0 || n >= sizeof(timestamp))
+	n = _snprintf(timestamp, TIMESTAMP_SIZE, "%s.%03d%+03d:%02d", strf, millis, -gmtoff / 3600, abs(gmtoff) % 3600 / 60);
+	if (n < 0 || n >= TIMESTAMP_SIZE)
 		return ERR_TIMESTAMP;
 	return timestamp;
 }
 #elif defined __linux__
 #include <time.h>
 #include <sys/time.h>
-const char* GetTimestamp()
+const char* GetTimestamp(char timestamp[TIMESTAMP_SIZE])
 {
 	time_t now;
 	struct timeval tv;
@@ -86,8 +90,8 @@ const char* GetTimestamp()
 	n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
 	if (n == 0)
 		return ERR_TIMESTAMP;
-	n = snprintf(timestamp, sizeof(timestamp), "%s.%03d%+03d:%02d", strf, (int)tv.tv_usec / 1000, gmtoff / 3600, gmtoff % 3600 / 60);
-	if (n < 0 || n >= sizeof(timestamp))
+	n = snprintf(timestamp, TIMESTAMP_SIZE, "%s.%03d%+03d:%02d", strf, (int)tv.tv_usec / 1000, gmtoff / 3600, gmtoff % 3600 / 60);
+	if (n < 0 || n >= TIMESTAMP_SIZE)
 		return ERR_TIMESTAMP;
 	return timestamp;
 }
@@ -95,7 +99,7 @@ const char* GetTimestamp()
 #error "Must implement GetTimestamp() AND getpid() for your operating system, OR use different logging methods."
 #endif
 
-static int pid;
+static int pid; /* cached by the first message, before any thread starts */
 int GetPid()
 {
 	if (!pid)
@@ -103,12 +107,22 @@ int GetPid()
 	return pid;
 }
 
+static void log_line(FILE* stream, char level, const char* fmt, va_list args)
+{
+	char timestamp[TIMESTAMP_SIZE], line[LINE_SIZE];
+	int n = snprintf(line, sizeof(line), "@%c %s [%d]: ", level, GetTimestamp(timestamp), GetPid());
+	if (n < 0 || n >= sizeof(line))
+		n = 0;
+	vsnprintf(line + n, sizeof(line) - n, fmt, args);
+	line[sizeof(line) - 1] = 0; /* _vsnprintf doesn't terminate truncated lines */
+	fputs(line, stream);
+}
+
 void _log_err(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "@E %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stderr, fmt, args);
+	log_line(stderr, 'E', fmt, args);
 	va_end(args);
 }
 
@@ -116,8 +130,7 @@ void _log_wrn(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "@W %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stderr, fmt, args);
+	log_line(stderr, 'W', fmt, args);
 	va_end(args);
 }
 
@@ -125,7 +138,6 @@ void _log_inf(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stdout, "@I %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stdout, fmt, args);
+	log_line(stdout, 'I', fmt, args);
 	va_end(args);
 }
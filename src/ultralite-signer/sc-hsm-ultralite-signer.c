@@ -17,19 +17,24 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 #include <ultralite/log.h>
 #include <ultralite/sc-hsm-ultralite.h>
+#include <ultralite/thread.h>
 #include "metadata.h"
+#include "uring.h"
 
 #ifdef _WIN32
 #ifdef DEBUG
 #include <crtdbg.h>
 #endif
 #include "ext-win/dirent.h"
+#include <io.h>
+#include <fcntl.h>
 typedef __int64 offset_t;
 /* define below after <stdio.h> */
 #define snprintf _snprintf
@@ -40,6 +45,12 @@ typedef __int64 offset_t;
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/inotify.h>
 #define MAX_PATH PATH_MAX
 typedef off_t offset_t;
 #if !defined __USE_FILE_OFFSET64
@@ -126,47 +137,76 @@ void release_lock(void* _fd)
 
 static char* sig_ext; /* either '.p7s' or ':p7s' */
 
+/* Files with at most BATCH_SIZE bytes left to hash are collected by
+   sign_files and hashed together, SHA256_MB_LANES files at a time */
+#define BATCH_SIZE 0x10000
+
 /**
- * Sign the file at the specified path using the private
- * key with the specified label on a token with the specified pin
- * and optionally with the beginning hash state saved in the
- * specified metadata_t from the previous signing.
+ * Structure for a file collected by sign_files, holding the content
+ * left to hash and the hash context to continue with.
  */
-static void sign(const char* path, const char* pin, const char* label,
-	metadata_t* md)
+typedef struct
 {
-	int n, err, sig_size;
+	char path[MAX_PATH];
 	sha256_context ctx;
-	sha256_context ctx_cpy;
-	const unsigned char *pCms = 0;
-	unsigned char buf[0x10000], hash[32]; /* 32 => 256-bit sha256 */
-	char sig_path[MAX_PATH] = "";
-	FILE * fpi = 0, * fpo = 0;
+	unsigned char* data;
+	unsigned int len;
+} batch_entry_t;
+
+static batch_entry_t batch[SHA256_MB_LANES];
+static int batch_count;
+static unsigned char* batch_buf; /* SHA256_MB_LANES * BATCH_SIZE bytes */
+
+/**
+ * Start a new hash context in ctx or, with the specified metadata_t from
+ * the previous signing, restore the saved hash context to ctx. Returns
+ * the length of the content already hashed.
+ */
+static offset_t start_hash(metadata_t* md, sha256_context* ctx)
+{
+	offset_t hcl;
+
+	if (!md) { /* No metadata */
+		/* Start a new hash context */
+		sha256_starts(ctx);
+		return 0;
+	}
+	/* Get the saved hashed content length (hcl) */
+	hcl = sizeof(hcl) == 4 ? md->cll : (offset_t)md->clh << 32 | md->cll;
+	/* Adjust the hcl back to the last block boundary */
+	hcl = hcl - hcl % sizeof(ctx->buffer);
+	/* Restore the "total" (hcl) field to the hash context */
+	ctx->total[0] = (unsigned int)hcl;
+	ctx->total[1] = (unsigned int)(hcl >> 32);
+	/* Restore the state field to the hash context */
+	memcpy(&ctx->state, &md->state, sizeof(ctx->state));
+	return hcl;
+}
+
+/**
+ * Open the file at the specified path for hashing. Either a new hash
+ * context is started in ctx or, with the specified metadata_t from the
+ * previous signing, the saved hash context is restored to ctx and the
+ * file is positioned at the end of the content already hashed.
+ * Returns the open file or 0 on error.
+ */
+static FILE* open_data(const char* path, metadata_t* md, sha256_context* ctx)
+{
+	FILE* fpi;
+	offset_t hcl;
+	int ok;
 
 	/* Open the data file for reading */
 	fpi = fopen(path, "rb");
 	if (!fpi) {
 		int e = errno;
 		log_err("error opening file '%s' for reading: %s", path, strerror(e));
-		goto sign_error;
+		return 0;
 	}
 
 	/* Get the saved hash context or start a new one */
-	if (!md) { /* No metadata */
-		/* Start a new hash context */
-		sha256_starts(&ctx);
-	} else { /* Metadata exists */
-		/* Restore the saved hash context */
-		int ok;
-		/* Get the saved hashed content length (hcl) */
-		offset_t hcl = sizeof(hcl) == 4 ? md->cll : (offset_t)md->clh << 32 | md->cll;
-		/* Adjust the hcl back to the last block boundary */
-		hcl = hcl - hcl % sizeof(ctx.buffer);
-		/* Restore the "total" (hcl) field to the hash context */
-		ctx.total[0] = (unsigned int)hcl;
-		ctx.total[1] = (unsigned int)(hcl >> 32);
-		/* Restore the state field to the hash context */
-		memcpy(&ctx.state, &md->state, sizeof(ctx.state));
+	hcl = start_hash(md, ctx);
+	if (md) { /* Metadata exists */
 		/* Seek to the position of hcl minus one & verify last byte still exists */
 		ok = hcl <= 0 || fseeko(fpi, hcl - 1, SEEK_SET) == 0 && getc(fpi) >= 0;
 		if (!ok) {
@@ -174,22 +214,26 @@ static void sign(const char* path, const char* pin, const char* label,
 				log_err("error seeking in '%s' to pos %d", path, (int)hcl);
 			else /* 64-bit hcl */
 				log_err("error seeking in '%s' to pos %lld", path, hcl);
-			goto sign_error;
+			fclose(fpi);
+			return 0;
 		}
 	}
+	return fpi;
+}
 
-	/* Create/Continue a SHA-256 hash of the file */
-	for (;;) {
-		int n = fread(buf, 1, sizeof(buf), fpi);
-		if (n <= 0)
-			break;
-		sha256_update(&ctx, buf, n);
-	}
+/**
+ * Close the data file at the specified path after hashing.
+ * Returns 0 on success.
+ */
+static int close_data(const char* path, FILE* fpi)
+{
+	int err;
 
 	/* Check for error during read */
 	if (ferror(fpi)) {
 		log_err("error reading file '%s'", path);
-		goto sign_error;
+		fclose(fpi);
+		return -1;
 	}
 
 	/* Close the data file */
@@ -197,22 +241,22 @@ static void sign(const char* path, const char* pin, const char* label,
 	if (err) {
 		int e = errno;
 		log_err("error closing file '%s': %s", path, strerror(e));
-		goto sign_error;
+		return -1;
 	}
-	fpi = 0;
-
-	/* Clone the unfinalized hash context to save in the metadata */
-	memcpy(&ctx_cpy, &ctx, sizeof(ctx));
-
-	/* Finalize the hash for the current sig */
-	sha256_finish(&ctx, hash);
+	return 0;
+}
 
-	/* Sign the hash with the token; creates CMS document & puts ptr in pCMS
-	   WARNING: sign_hash is not re-entrant (see sc-hsm-ultralite.c) */
-	sig_size = sign_hash(pin, label, hash, sizeof(hash), &pCms);
-	if (sig_size <= 0) {
-		goto sign_error;
-	}
+/**
+ * Write the signature file of the file at the specified path with the
+ * CMS document pCms of sig_size bytes and the unfinalized hash context
+ * ctx_cpy as metadata.
+ */
+static void write_p7s(const char* path, const unsigned char* pCms, int sig_size,
+	sha256_context* ctx_cpy)
+{
+	int n, err;
+	char sig_path[MAX_PATH] = "";
+	FILE * fpo = 0;
 
 	/* Open the new sig file for writing */
 	n = snprintf(sig_path, sizeof(sig_path), "%s%s", path, sig_ext);
@@ -236,7 +280,7 @@ static void sign(const char* path, const char* pin, const char* label,
 	}
 
 	/* Save "total" (hcl) & unfinalized hash state at end of sig file */
-	err = write_metadata(fpo, &ctx_cpy);
+	err = write_metadata(fpo, ctx_cpy);
 	if (err) {
 		log_err("error writing metadata to sig file '%s'", sig_path);
 		goto sign_error;
@@ -255,15 +299,6 @@ static void sign(const char* path, const char* pin, const char* label,
 	return;
 
 sign_error:
-	/* Close input file stream, if open */
-	if (fpi) {
-		err = fclose(fpi);
-		if (err) {
-			int e = errno;
-			log_err("error closing file '%s': %s",
-				path, strerror(e));
-		}
-	}
 	/* Close output file stream, if open */
 	if (fpo) {
 		err = fclose(fpo);
@@ -276,6 +311,623 @@ sign_error:
 	return;
 }
 
+/**
+ * Sign the specified hash of the file at the specified path using the
+ * private key with the specified label on a token with the specified
+ * pin and write the signature file with the unfinalized hash context
+ * ctx_cpy as metadata.
+ */
+static void write_sig(const char* path, const char* pin, const char* label,
+	const unsigned char hash[32], sha256_context* ctx_cpy)
+{
+	int sig_size;
+	const unsigned char *pCms = 0;
+
+	/* Sign the hash with the token; creates CMS document & puts ptr in pCMS
+	   WARNING: sign_hash is not re-entrant (see sc-hsm-ultralite.c) */
+	sig_size = sign_hash(pin, label, hash, 32, &pCms);
+	if (sig_size <= 0)
+		return;
+
+	write_p7s(path, pCms, sig_size, ctx_cpy);
+}
+
+#ifdef __linux__
+/* Size of the part of a file mapped at a time by hash_mapped */
+#define MAP_WINDOW (64 << 20)
+
+/* Files with less left to hash are read with fread, see hash_mapped */
+#define MAP_MIN 0x100000
+
+static int use_mmap;
+static __thread sigjmp_buf* map_jmp; /* set while hashing from a mapping */
+
+/**
+ * Handler for SIGBUS, raised when a mapped file shrinks below a page
+ * being hashed.
+ */
+static void on_sigbus(int sig)
+{
+	if (map_jmp)
+		siglongjmp(*map_jmp, 1);
+	signal(SIGBUS, SIG_DFL);
+	raise(SIGBUS);
+}
+
+/**
+ * Continue the hash ctx of the file opened as fpi from the current
+ * position to the end of the file by mapping it, which saves copying
+ * the content. Data appended meanwhile is left to the caller's fread.
+ * Returns 0 on success, 1 if the file is not worth mapping and -1 on
+ * error, including a file shrinking or changed in place while hashing,
+ * which the mapping doesn't notice unless it shrinks past a page.
+ */
+static int hash_mapped(const char* path, FILE* fpi, sha256_context* ctx)
+{
+	struct stat info, after;
+	sigjmp_buf jmp;
+	unsigned char* volatile map = 0;
+	volatile size_t map_len = 0;
+	offset_t pos, end, off;
+	long page = sysconf(_SC_PAGESIZE);
+	int fd = fileno(fpi);
+
+	pos = ftello(fpi);
+	if (pos < 0 || fstat(fd, &info) || info.st_size - pos < MAP_MIN)
+		return 1;
+	end = info.st_size;
+
+	if (sigsetjmp(jmp, 1)) {
+		map_jmp = 0;
+		if (map)
+			munmap(map, map_len);
+		log_err("error reading file '%s': shrunk while hashing", path);
+		return -1;
+	}
+	map_jmp = &jmp;
+
+	for (off = pos; off < end; ) {
+		offset_t base = off - off % page;
+		offset_t len = end - base < MAP_WINDOW ? end - base : MAP_WINDOW;
+		unsigned char* p = mmap(0, (size_t)len, PROT_READ, MAP_SHARED, fd, base);
+		if (p == MAP_FAILED) {
+			int e = errno;
+			map_jmp = 0;
+			log_err("error mapping file '%s': %s", path, strerror(e));
+			return -1;
+		}
+		map = p;
+		map_len = (size_t)len;
+		/* Read ahead aggressively and drop the pages once hashed */
+		madvise(p, (size_t)len, MADV_SEQUENTIAL);
+		madvise(p, (size_t)len, MADV_WILLNEED);
+		sha256_update(ctx, p + (off - base), (unsigned int)(base + len - off));
+		map = 0;
+		munmap(p, (size_t)len);
+		off = base + len;
+	}
+	map_jmp = 0;
+
+	/* Appending changes the mtime too, only without growth it was a change in place */
+	if (fstat(fd, &after) || after.st_size < end
+		|| (after.st_size == end
+		&& (after.st_mtim.tv_sec != info.st_mtim.tv_sec
+			|| after.st_mtim.tv_nsec != info.st_mtim.tv_nsec))) {
+		log_err("error reading file '%s': shrunk or modified while hashing", path);
+		return -1;
+	}
+
+	/* Continue with fread after the mapped part */
+	if (fseeko(fpi, end, SEEK_SET)) {
+		log_err("error seeking in '%s'", path);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/**
+ * Hash the file at the specified path, optionally continuing with the
+ * hash state saved in the specified metadata_t from the previous
+ * signing. Returns 0 on success with the hash and the unfinalized hash
+ * context for the metadata in ctx_cpy.
+ */
+static int hash_file(const char* path, metadata_t* md,
+	sha256_context* ctx_cpy, unsigned char hash[32])
+{
+	sha256_context ctx;
+	unsigned char buf[0x10000];
+	FILE * fpi;
+
+	/* Open the data file & get the hash context to continue with */
+	fpi = open_data(path, md, &ctx);
+	if (!fpi)
+		return -1;
+
+#ifdef __linux__
+	/* Hash the bulk of a large file without copying it */
+	if (use_mmap && hash_mapped(path, fpi, &ctx) < 0) {
+		fclose(fpi);
+		return -1;
+	}
+#endif
+
+	/* Create/Continue a SHA-256 hash of the file */
+	for (;;) {
+		int n = fread(buf, 1, sizeof(buf), fpi);
+		if (n <= 0)
+			break;
+		sha256_update(&ctx, buf, n);
+	}
+
+	if (close_data(path, fpi))
+		return -1;
+
+	/* Clone the unfinalized hash context to save in the metadata */
+	memcpy(ctx_cpy, &ctx, sizeof(ctx));
+
+	/* Finalize the hash for the current sig */
+	sha256_finish(&ctx, hash);
+	return 0;
+}
+
+/**
+ * Sign the file at the specified path using the private
+ * key with the specified label on a token with the specified pin
+ * and optionally with the beginning hash state saved in the
+ * specified metadata_t from the previous signing.
+ */
+static void sign(const char* path, const char* pin, const char* label,
+	metadata_t* md)
+{
+	sha256_context ctx_cpy;
+	unsigned char hash[32]; /* 32 => 256-bit sha256 */
+
+	if (hash_file(path, md, &ctx_cpy, hash) == 0)
+		write_sig(path, pin, label, hash, &ctx_cpy);
+}
+
+/* Number of files each queue of the pipeline holds before the stage
+   feeding it waits */
+#define PIPELINE_DEPTH 16
+
+/* Space for the CMS of a file in the pipeline, the largest template
+   (the length of a template is 16 bit) */
+#define PIPELINE_CMS_SIZE 0x10000
+
+/**
+ * Structure for a file passing through the pipeline, see pipeline_start.
+ */
+typedef struct job
+{
+	struct job* next;
+	char path[MAX_PATH];
+	metadata_t md;
+	int resume;              /* continue with the hash state in md */
+	sha256_context ctx_cpy;  /* unfinalized, for the metadata */
+	unsigned char hash[32];
+	unsigned char cms[PIPELINE_CMS_SIZE];
+	int cms_size;
+} job_t;
+
+/**
+ * Structure for a bounded queue between two stages of the pipeline.
+ */
+typedef struct
+{
+	LOCK_T lock;
+	COND_T cond; /* signaled on put, get and close */
+	job_t* head;
+	job_t* tail;
+	int count;
+	int closed;  /* no more puts, get returns 0 once empty */
+} queue_t;
+
+/**
+ * The pipeline: the caller (walker) checks the files and queues them
+ * for the hashing threads, a single thread signs the hashes with the
+ * token and another one writes the signature files.
+ */
+static struct
+{
+	int jobs;    /* hashing threads, 0 if the pipeline is not running */
+	int hashing; /* hashing threads not finished, under hash_q.lock */
+	ul_ctx_t* ctx; /* token session of the signing thread */
+	const char* label;
+	queue_t hash_q, sign_q, write_q;
+	THREAD_T* hashers;
+	THREAD_T signer, writer;
+} pipeline;
+
+static void queue_init(queue_t* q)
+{
+	memset(q, 0, sizeof(*q));
+	lock_init(&q->lock);
+	cond_init(&q->cond);
+}
+
+static void queue_destroy(queue_t* q)
+{
+	cond_destroy(&q->cond);
+	lock_destroy(&q->lock);
+}
+
+/**
+ * Append the job to the queue, waiting while the queue is full.
+ */
+static void queue_put(queue_t* q, job_t* job)
+{
+	job->next = 0;
+	lock_enter(&q->lock);
+	while (q->count >= PIPELINE_DEPTH)
+		cond_wait(&q->cond, &q->lock);
+	if (q->tail)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+	q->count++;
+	cond_broadcast(&q->cond);
+	lock_leave(&q->lock);
+}
+
+/**
+ * Remove the first job from the queue, waiting while the queue is
+ * empty. Returns 0 once the queue is closed and empty.
+ */
+static job_t* queue_get(queue_t* q)
+{
+	job_t* job;
+	lock_enter(&q->lock);
+	while (!q->head && !q->closed)
+		cond_wait(&q->cond, &q->lock);
+	job = q->head;
+	if (job) {
+		q->head = job->next;
+		if (!q->head)
+			q->tail = 0;
+		q->count--;
+		cond_broadcast(&q->cond);
+	}
+	lock_leave(&q->lock);
+	return job;
+}
+
+static void queue_close(queue_t* q)
+{
+	lock_enter(&q->lock);
+	q->closed = 1;
+	cond_broadcast(&q->cond);
+	lock_leave(&q->lock);
+}
+
+/**
+ * Hashing stage, the last thread to finish closes the signing queue.
+ */
+static THREAD_FUNC(hash_main, arg)
+{
+	job_t* job;
+	int last;
+
+	while ((job = queue_get(&pipeline.hash_q)) != 0) {
+		if (hash_file(job->path, job->resume ? &job->md : 0, &job->ctx_cpy, job->hash))
+			free(job);
+		else
+			queue_put(&pipeline.sign_q, job);
+	}
+
+	lock_enter(&pipeline.hash_q.lock);
+	last = --pipeline.hashing == 0;
+	lock_leave(&pipeline.hash_q.lock);
+	if (last)
+		queue_close(&pipeline.sign_q);
+	return THREAD_RETURN;
+}
+
+/**
+ * Signing stage, the only thread using the token while the pipeline
+ * runs. The CMS is signed straight into the job for the writer.
+ */
+static THREAD_FUNC(sign_main, arg)
+{
+	job_t* job;
+
+	while ((job = queue_get(&pipeline.sign_q)) != 0) {
+		job->cms_size = ul_sign_into(pipeline.ctx, pipeline.label, job->hash, 32,
+			job->cms, sizeof(job->cms));
+		if (job->cms_size <= 0) {
+			if (job->cms_size == ERR_MEMORY) /* also returned for a too small buffer */
+				log_err("error signing '%s': CMS larger than %d bytes or out of memory",
+					job->path, (int)sizeof(job->cms));
+			else
+				log_err("error signing '%s': %d", job->path, job->cms_size);
+			free(job);
+			continue;
+		}
+		queue_put(&pipeline.write_q, job);
+	}
+	queue_close(&pipeline.write_q);
+	return THREAD_RETURN;
+}
+
+/**
+ * Writing stage.
+ */
+static THREAD_FUNC(write_main, arg)
+{
+	job_t* job;
+
+	while ((job = queue_get(&pipeline.write_q)) != 0) {
+		write_p7s(job->path, job->cms, job->cms_size, &job->ctx_cpy);
+		free(job);
+	}
+	return THREAD_RETURN;
+}
+
+/**
+ * Start the pipeline with the specified number of hashing threads, so
+ * reading and hashing files, signing with the token and writing the
+ * signature files overlap. The signing thread opens its own token
+ * session, with the template cache in cache_dir if not 0. Until
+ * pipeline_finish, sign_file and sign_entry queue the files instead of
+ * signing them. Returns 0 on success.
+ */
+static int pipeline_start(int jobs, const char* pin, const char* label,
+	const char* cache_dir)
+{
+	int i;
+
+	if (ul_open(0, pin, &pipeline.ctx) < 0)
+		return -1;
+	if (cache_dir)
+		ul_set_cache_dir(pipeline.ctx, cache_dir);
+	pipeline.label = label;
+	pipeline.hashers = malloc(jobs * sizeof(THREAD_T));
+	if (!pipeline.hashers)
+		goto start_error;
+	queue_init(&pipeline.hash_q);
+	queue_init(&pipeline.sign_q);
+	queue_init(&pipeline.write_q);
+
+	if (thread_start(&pipeline.writer, write_main, 0))
+		goto start_error;
+	if (thread_start(&pipeline.signer, sign_main, 0)) {
+		queue_close(&pipeline.write_q);
+		thread_join(pipeline.writer);
+		goto start_error;
+	}
+	pipeline.hashing = jobs;
+	for (i = 0; i < jobs; i++) {
+		if (thread_start(&pipeline.hashers[i], hash_main, 0))
+			break;
+	}
+	if (i < jobs) {
+		log_wrn("%d of %d hashing threads started", i, jobs);
+		lock_enter(&pipeline.hash_q.lock);
+		pipeline.hashing -= jobs - i;
+		lock_leave(&pipeline.hash_q.lock);
+		if (i == 0) {
+			queue_close(&pipeline.sign_q);
+			thread_join(pipeline.signer);
+			thread_join(pipeline.writer);
+			goto start_error;
+		}
+	}
+	pipeline.jobs = i;
+	log_inf("pipeline with %d hashing thread(s) started", i);
+	return 0;
+
+start_error:
+	if (pipeline.hashers) {
+		queue_destroy(&pipeline.hash_q);
+		queue_destroy(&pipeline.sign_q);
+		queue_destroy(&pipeline.write_q);
+		free(pipeline.hashers);
+		pipeline.hashers = 0;
+	}
+	ul_close(pipeline.ctx);
+	pipeline.ctx = 0;
+	return -1;
+}
+
+/**
+ * Queue the file at the specified path for the pipeline. Like sign, md
+ * is the metadata_t from the previous signing or 0.
+ */
+static void pipeline_add(const char* path, metadata_t* md)
+{
+	job_t* job = malloc(sizeof(job_t));
+
+	if (!job) {
+		log_err("out of memory, '%s' not signed", path);
+		return;
+	}
+	strcpy(job->path, path);
+	job->resume = md != 0;
+	if (md)
+		job->md = *md;
+	queue_put(&pipeline.hash_q, job);
+}
+
+/**
+ * Sign the files still queued and stop the pipeline.
+ */
+static void pipeline_finish()
+{
+	int i;
+
+	queue_close(&pipeline.hash_q);
+	for (i = 0; i < pipeline.jobs; i++)
+		thread_join(pipeline.hashers[i]);
+	thread_join(pipeline.signer);
+	thread_join(pipeline.writer);
+	queue_destroy(&pipeline.hash_q);
+	queue_destroy(&pipeline.sign_q);
+	queue_destroy(&pipeline.write_q);
+	free(pipeline.hashers);
+	pipeline.hashers = 0;
+	pipeline.jobs = 0;
+	ul_close(pipeline.ctx);
+	pipeline.ctx = 0;
+}
+
+/**
+ * The io_uring read engine, see uring.c: the files are read with many
+ * requests in flight and hashed by the caller's thread as the chunks
+ * complete, then signed like with sign or by the pipeline.
+ */
+static struct
+{
+	int active;
+	const char* pin;
+	const char* label;
+} uring;
+
+/**
+ * Completion of a file passed to uring_hash.
+ */
+static void uring_done(void* user, sha256_context* ctx)
+{
+	job_t* job = (job_t*)user;
+
+	if (!ctx) {
+		free(job);
+		return;
+	}
+
+	/* Clone the unfinalized hash context to save in the metadata */
+	memcpy(&job->ctx_cpy, ctx, sizeof(*ctx));
+
+	/* Finalize the hash for the current sig */
+	sha256_finish(ctx, job->hash);
+
+	if (pipeline.jobs) {
+		queue_put(&pipeline.sign_q, job);
+	} else {
+		write_sig(job->path, uring.pin, uring.label, job->hash, &job->ctx_cpy);
+		free(job);
+	}
+}
+
+/**
+ * Queue the file at the specified path of the specified size for the
+ * io_uring read engine. Like sign, md is the metadata_t from the
+ * previous signing or 0.
+ */
+static void uring_add(const char* path, metadata_t* md, offset_t size)
+{
+	job_t* job = malloc(sizeof(job_t));
+	sha256_context ctx;
+	offset_t hcl;
+
+	if (!job) {
+		log_err("out of memory, '%s' not signed", path);
+		return;
+	}
+	strcpy(job->path, path);
+	hcl = start_hash(md, &ctx);
+	uring_hash(job->path, hcl, size, &ctx, uring_done, job);
+}
+
+/**
+ * Pass the file at the specified path to the io_uring engine or the
+ * pipeline if one of them is running. Returns 1 if the file was queued
+ * and 0 if the caller signs it.
+ */
+static int queue_file(const char* path, metadata_t* md, offset_t size)
+{
+	if (uring.active) {
+		uring_add(path, md, size);
+		return 1;
+	}
+	if (pipeline.jobs) {
+		pipeline_add(path, md);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Hash the files collected in the batch in parallel and sign them.
+ */
+static void flush_batch(const char* pin, const char* label)
+{
+	sha256_context* ctx[SHA256_MB_LANES];
+	sha256_context ctx_cpy[SHA256_MB_LANES];
+	unsigned char* input[SHA256_MB_LANES];
+	unsigned char* digest[SHA256_MB_LANES];
+	unsigned char hash[SHA256_MB_LANES][32];
+	unsigned int length[SHA256_MB_LANES];
+	int i;
+
+	for (i = 0; i < batch_count; i++) {
+		ctx[i] = &batch[i].ctx;
+		input[i] = batch[i].data;
+		length[i] = batch[i].len;
+		digest[i] = hash[i];
+	}
+
+	/* Continue the SHA-256 hashes of all files at once */
+	sha256_update_mb(ctx, input, length, batch_count);
+
+	/* Clone the unfinalized hash contexts to save in the metadata */
+	for (i = 0; i < batch_count; i++)
+		memcpy(&ctx_cpy[i], ctx[i], sizeof(ctx_cpy[i]));
+
+	/* Finalize the hashes for the current sigs */
+	sha256_finish_mb(ctx, digest, batch_count);
+
+	for (i = 0; i < batch_count; i++)
+		write_sig(batch[i].path, pin, label, hash[i], &ctx_cpy[i]);
+
+	batch_count = 0;
+}
+
+/**
+ * Add the file at the specified path to the batch, reading the content
+ * left to hash, and flush the batch when full. Like sign, md is the
+ * metadata_t from the previous signing or 0.
+ */
+static void batch_file(const char* path, const char* pin, const char* label,
+	metadata_t* md)
+{
+	batch_entry_t* entry = &batch[batch_count];
+	FILE* fpi;
+	int n;
+
+	if (!batch_buf) {
+		batch_buf = malloc(SHA256_MB_LANES * BATCH_SIZE);
+		if (!batch_buf) {
+			sign(path, pin, label, md);
+			return;
+		}
+	}
+
+	/* Open the data file & get the hash context to continue with */
+	fpi = open_data(path, md, &entry->ctx);
+	if (!fpi)
+		return;
+
+	/* Read the rest of the file */
+	entry->data = batch_buf + batch_count * BATCH_SIZE;
+	n = fread(entry->data, 1, BATCH_SIZE, fpi);
+	if (n == BATCH_SIZE && getc(fpi) != EOF) {
+		/* Grown meanwhile, too large for the batch */
+		fclose(fpi);
+		sign(path, pin, label, md);
+		return;
+	}
+
+	if (close_data(path, fpi))
+		return;
+
+	strcpy(entry->path, path);
+	entry->len = n;
+
+	if (++batch_count == SHA256_MB_LANES)
+		flush_batch(pin, label);
+}
+
 /**
  * Determine if the file at the specified path needs to be signed.
  * Signing only occurs if the file is new (i.e. not yet signed),
@@ -283,10 +935,11 @@ sign_error:
  * determined by reading the hcl ("total") from the metadata stored
  * at the end of the associated signature file and comparing with the
  * current size of the specified file.
- * If a new signature is necessary, the sign function above will be
- * called with the specified pin and label.
+ * Returns -1 if no new signature is necessary, 0 if the file must be
+ * hashed from the beginning and 1 if hashing continues from the state
+ * saved in md. The file size is returned in size.
  */
-void sign_file(const char* path, const char* pin, const char* label)
+static int check_file(const char* path, metadata_t* md, offset_t* size)
 {
 	int n, err;
 	struct stat entry_info;
@@ -298,24 +951,25 @@ void sign_file(const char* path, const char* pin, const char* label)
 	if (err) {
 		int e = errno;
 		log_err("error accessing file '%s': %s", path, strerror(e));
-		return;
+		return -1;
 	}
 
 	/* Only sign files */
 	if (S_ISDIR(entry_info.st_mode))
-		return;
+		return -1;
 
 	/* Skip empty files */
 	if (entry_info.st_size <= 0) {
 		log_inf("'%s' empty", path);
-		return;
+		return -1;
 	}
+	*size = entry_info.st_size;
 
 	/* Build associated sig file path (i.e. <path>/<filename><sig_ext>) */
 	n = snprintf(sig_path, sizeof(sig_path), "%s%s", path, sig_ext);
 	if (n < 0 || n >= sizeof(sig_path)) {
 		log_err("error building sig file path '%s%s'", path, sig_ext);
-		return;
+		return -1;
 	}
 
 	/* Try to open the sig file to see if one exists yet */
@@ -326,17 +980,16 @@ void sign_file(const char* path, const char* pin, const char* label)
 
 	if (!err) { /* Sig file found => figure out if we need to re-create it */
 		/* Read the metadata from the sig file */
-		metadata_t md;
-		err = read_metadata(sig_path, &md);
+		err = read_metadata(sig_path, md);
 		if (err) {
 			log_err("error reading metadata from sig file '%s'; will be re-created", sig_path);
 		} else {
 			/* Figure out if we need to re-create the sig file */
-			offset_t hcl = sizeof(hcl) == 4 ? md.cll : (offset_t)md.clh << 32 | md.cll;
+			offset_t hcl = sizeof(hcl) == 4 ? md->cll : (offset_t)md->clh << 32 | md->cll;
 			if (entry_info.st_size == hcl) {
 				/* Unmodified so skip */
 				log_inf("'%s' unmodified", path);
-				return;
+				return -1;
 			} else if (entry_info.st_size < hcl) {
 				/* Shrunk so re-sign */
 				log_wrn("'%s' shrunk", path);
@@ -347,7 +1000,7 @@ void sign_file(const char* path, const char* pin, const char* label)
 			}
 		}
 		/* Create/re-create sig file */
-		sign(path, pin, label, err ? 0 : &md);
+		return err ? 0 : 1;
 	} else { /* No sig file found (or err reading it) => create/re-create */
 		int e = errno;
 		if (e == ENOENT) /* A sig file doesn't yet exist, assume file is new */
@@ -355,13 +1008,58 @@ void sign_file(const char* path, const char* pin, const char* label)
 		else /* Error accessing an existing sig file */
 			log_err("error accessing sig file '%s': %s; will be re-created", sig_path, strerror(e));
 		/* Create/re-create sig file */
-		sign(path, pin, label, 0);
+		return 0;
+	}
+}
+
+/**
+ * Sign the file at the specified path if necessary (see check_file)
+ * with the specified pin and label.
+ */
+void sign_file(const char* path, const char* pin, const char* label)
+{
+	metadata_t md;
+	offset_t size;
+	int rv;
+
+	rv = check_file(path, &md, &size);
+	if (rv < 0)
+		return;
+	if (!queue_file(path, rv ? &md : 0, size))
+		sign(path, pin, label, rv ? &md : 0);
+}
+
+/**
+ * Sign the file at the specified path if necessary (see check_file)
+ * like sign_file, but add it to the batch if little is left to hash.
+ * The caller flushes the batch.
+ */
+static void sign_entry(const char* path, const char* pin, const char* label)
+{
+	metadata_t md;
+	offset_t size, hcl;
+	int rv;
+
+	rv = check_file(path, &md, &size);
+	if (rv < 0)
+		return;
+	if (queue_file(path, rv ? &md : 0, size))
+		return;
+	hcl = 0;
+	if (rv) {
+		hcl = sizeof(hcl) == 4 ? md.cll : (offset_t)md.clh << 32 | md.cll;
+		hcl = hcl - hcl % 64;
 	}
+	if (size - hcl <= BATCH_SIZE)
+		batch_file(path, pin, label, rv ? &md : 0);
+	else
+		sign(path, pin, label, rv ? &md : 0);
 }
 
 /**
- * Scan through the specified (directory) path and call sign_file on
- * each file that is not hidden nor a signature (.p7s).
+ * Scan through the specified (directory) path and sign each file that
+ * is not hidden nor a signature (.p7s) if necessary (see check_file).
+ * Small files are hashed in batches of SHA256_MB_LANES files.
  * The specified pin and label will be used for signing, if necessary.
  */
 void sign_files(const char* path, const char* pin, const char* label)
@@ -404,10 +1102,14 @@ void sign_files(const char* path, const char* pin, const char* label)
 			continue;
 		}
 
-		/* Sign the file */
-		sign_file(entry_path, pin, label);
+		/* Sign the file if necessary, small ones in batches */
+		sign_entry(entry_path, pin, label);
     }
 
+	/* Sign the rest of the batch */
+	if (batch_count)
+		flush_batch(pin, label);
+
 	/* Close the directory stream */
     err = closedir(dir);
 	if (err) {
@@ -417,24 +1119,407 @@ void sign_files(const char* path, const char* pin, const char* label)
 
 }
 
+/**
+ * Read the next NUL-terminated path from the specified stream into path.
+ * Returns the path length, 0 for an empty entry and -1 at the end of
+ * the stream. A path longer than size - 1 is skipped with -2.
+ */
+static int read_path(FILE* fp, char* path, int size)
+{
+	int c, n = 0;
+
+	while ((c = getc(fp)) != EOF && c != 0) {
+		if (n < size)
+			path[n] = (char)c;
+		n++;
+	}
+	if (c == EOF && n == 0)
+		return -1;
+	if (n >= size)
+		return -2;
+	path[n] = 0;
+	return n;
+}
+
+/**
+ * Sign the files listed NUL-separated (find -type f -print0) in the file
+ * with the specified name, "-" for stdin, like the paths passed as
+ * arguments. Listed directories are skipped, find lists their files as
+ * well and scanning them would sign those twice, concurrently with
+ * --jobs. Returns 0 or -1 if the list can't be read.
+ */
+static int sign_list(const char* name, const char* pin, const char* label)
+{
+	char path[MAX_PATH];
+	FILE* fp;
+	int n, count = 0, dirs = 0;
+
+	if (strcmp(name, "-") == 0) {
+		fp = stdin;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	} else {
+		fp = fopen(name, "rb");
+		if (!fp) {
+			int e = errno;
+			log_err("error opening list '%s': %s", name, strerror(e));
+			return -1;
+		}
+	}
+
+	while ((n = read_path(fp, path, sizeof(path))) != -1) {
+		struct stat info;
+
+		if (n == -2) {
+			log_err("path too long in list '%s'", name);
+			continue;
+		}
+		if (n == 0)
+			continue;
+
+		if (stat(path, &info)) {
+			int e = errno;
+			log_err("error accessing path '%s': %s", path, strerror(e));
+			continue;
+		}
+		if (S_ISDIR(info.st_mode)) {
+			if (dirs++ == 0)
+				log_wrn("directory '%s' in list '%s' skipped, list files only (find -type f)", path, name);
+			continue;
+		}
+		/* Skip signature files as find would list them */
+		if (n >= 4 && (strcmp(path + n - 4, ".p7s") == 0 || strcmp(path + n - 4, ":p7s") == 0))
+			continue;
+		sign_entry(path, pin, label);
+		count++;
+	}
+
+	/* Sign the rest of the batch */
+	if (batch_count)
+		flush_batch(pin, label);
+
+	if (ferror(fp))
+		log_err("error reading list '%s'", name);
+	if (fp != stdin)
+		fclose(fp);
+	if (dirs > 1)
+		log_wrn("%d directories in list '%s' skipped", dirs, name);
+	log_inf("%d file(s) to sign in list '%s'", count, name);
+	return 0;
+}
+
+/* Default time in ms a watched file must stay unchanged before it is signed */
+#define WATCH_DEBOUNCE 2000
+
+#ifdef __linux__
+/* Events that mark a file as changed */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY)
+
+/* Events that drop a file not yet signed */
+#define WATCH_GONE (IN_MOVED_FROM | IN_DELETE)
+
+/* Events that end the watch of a path, followed by IN_IGNORED once removed */
+#define WATCH_SELF (IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * Structure for a file changed within the debounce window, signed by
+ * watch_paths when it is due.
+ */
+typedef struct
+{
+	char path[MAX_PATH];
+	long long due; /* ms, see now_ms */
+} pending_t;
+
+static volatile sig_atomic_t watch_stop;
+
+static void on_signal(int sig)
+{
+	watch_stop = 1;
+}
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Determine if the directory entry with the specified name is skipped,
+ * i.e. hidden or a signature (.p7s) file.
+ */
+static int skip_name(const char* name)
+{
+	const char* ext;
+	if (name[0] == '.')
+		return 1;
+	ext = strrchr(name, '.');
+	if (ext && strcmp(ext, ".p7s") == 0)
+		return 1;
+	ext = strrchr(name, ':');
+	if (ext && strcmp(ext, ":p7s") == 0)
+		return 1;
+	return 0;
+}
+
+/**
+ * Sign the specified files and directories like main, then keep running
+ * and sign each file again once it was changed and stayed unchanged for
+ * debounce ms. The token session and the signing template are kept
+ * between the signatures. Directories are watched without their sub-
+ * directories, as with sign_files. A path deleted or moved away is no
+ * longer watched. Returns on SIGINT or SIGTERM, or when no path is left.
+ */
+static int watch_paths(char** paths, int count, const char* pin,
+	const char* label, int debounce)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char** wd_path = 0; /* path by watch descriptor */
+	int wd_max = 0, watches = 0, fd, i, n, j;
+	pending_t* pending = 0;
+	int pending_count = 0, pending_max = 0;
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		int e = errno;
+		log_err("error initializing inotify: %s", strerror(e));
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		int wd = inotify_add_watch(fd, paths[i], WATCH_EVENTS | WATCH_GONE | WATCH_SELF);
+		if (wd < 0) {
+			int e = errno;
+			log_err("error watching path '%s': %s", paths[i], strerror(e));
+			continue;
+		}
+		if (wd >= wd_max) {
+			char** p = realloc(wd_path, (wd + 16) * sizeof(char*));
+			if (!p) {
+				log_err("out of memory");
+				break;
+			}
+			memset(p + wd_max, 0, (wd + 16 - wd_max) * sizeof(char*));
+			wd_path = p;
+			wd_max = wd + 16;
+		}
+		if (!wd_path[wd])
+			watches++;
+		wd_path[wd] = paths[i];
+		log_inf("watching '%s'", paths[i]);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	/* Catch up with the changes made while not running */
+	for (i = 0; i < count; i++) {
+		struct stat info;
+		if (stat(paths[i], &info) == 0 && S_ISDIR(info.st_mode))
+			sign_files(paths[i], pin, label);
+		else
+			sign_file(paths[i], pin, label);
+	}
+
+	if (watches == 0)
+		log_err("no path to watch");
+
+	while (!watch_stop && watches > 0) {
+		struct pollfd pfd;
+		long long now = now_ms(), next = -1;
+
+		/* Sign the files that settled, keep the others */
+		for (i = j = 0; i < pending_count; i++) {
+			if (pending[i].due <= now)
+				sign_file(pending[i].path, pin, label);
+			else {
+				if (next < 0 || pending[i].due < next)
+					next = pending[i].due;
+				pending[j++] = pending[i];
+			}
+		}
+		pending_count = j;
+		uring_drain();
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		n = poll(&pfd, 1, next < 0 ? -1 : (int)(next - now));
+		if (n < 0) {
+			int e = errno;
+			if (e == EINTR)
+				continue;
+			log_err("error polling inotify: %s", strerror(e));
+			break;
+		}
+		if (n == 0)
+			continue;
+
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0) {
+			int e = errno;
+			if (e == EINTR || e == EAGAIN)
+				continue;
+			log_err("error reading inotify: %s", strerror(e));
+			break;
+		}
+
+		now = now_ms();
+		for (i = 0; i < n; ) {
+			const struct inotify_event* ev = (const struct inotify_event*)(buf + i);
+			char path[MAX_PATH];
+			const char* root;
+			int k;
+
+			i += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Events lost, rescan everything like at startup */
+				struct stat info;
+				log_wrn("inotify queue overflow");
+				for (k = 0; k < wd_max; k++) {
+					if (!wd_path[k])
+						continue;
+					if (stat(wd_path[k], &info) == 0 && S_ISDIR(info.st_mode))
+						sign_files(wd_path[k], pin, label);
+					else
+						sign_file(wd_path[k], pin, label);
+				}
+				continue;
+			}
+			if (ev->wd < 0 || ev->wd >= wd_max || !wd_path[ev->wd])
+				continue;
+			root = wd_path[ev->wd];
+
+			if (ev->mask & (WATCH_SELF | IN_IGNORED)) {
+				size_t len = strlen(root);
+				/* A moved path keeps its watch, remove it */
+				if (ev->mask & IN_MOVE_SELF)
+					inotify_rm_watch(fd, ev->wd);
+				log_wrn("'%s' deleted or moved, no longer watched", root);
+				/* Drop the pending files below the path */
+				for (j = k = 0; j < pending_count; j++) {
+					if (strncmp(pending[j].path, root, len) == 0
+						&& (pending[j].path[len] == 0 || pending[j].path[len] == '/'))
+						continue;
+					pending[k++] = pending[j];
+				}
+				pending_count = k;
+				wd_path[ev->wd] = 0;
+				if (--watches == 0)
+					log_err("no path left to watch");
+				continue;
+			}
+
+			if (ev->len == 0) { /* Watched file itself */
+				strcpy(path, root);
+			} else {
+				if (skip_name(ev->name) || ev->mask & IN_ISDIR)
+					continue;
+				k = snprintf(path, sizeof(path), "%s/%s", root, ev->name);
+				if (k < 0 || k >= sizeof(path)) {
+					log_err("error building entry path '%s/%s'", root, ev->name);
+					continue;
+				}
+			}
+
+			for (k = 0; k < pending_count; k++)
+				if (strcmp(pending[k].path, path) == 0)
+					break;
+
+			/* Renamed or deleted before it settled */
+			if (ev->mask & WATCH_GONE) {
+				if (k < pending_count)
+					pending[k] = pending[--pending_count];
+				continue;
+			}
+
+			/* (Re)start the debounce window of the file */
+			if (k == pending_count) {
+				if (pending_count == pending_max) {
+					pending_t* p = realloc(pending, (pending_max + 64) * sizeof(pending_t));
+					if (!p) {
+						log_err("out of memory, signing '%s' now", path);
+						sign_file(path, pin, label);
+						continue;
+					}
+					pending = p;
+					pending_max += 64;
+				}
+				strcpy(pending[k].path, path);
+				pending_count++;
+			}
+			pending[k].due = now + debounce;
+		}
+	}
+
+	/* Sign what is left before leaving */
+	for (i = 0; i < pending_count; i++)
+		sign_file(pending[i].path, pin, label);
+
+	log_inf("watch stopped");
+	free(pending);
+	free(wd_path);
+	close(fd);
+	return 0;
+}
+#endif
+
 int main(int argc, char** argv)
 {
-	int i, usealt;
-	const char * pin, * label;
+	int i, first, usealt = 0, watch = 0, debounce = WATCH_DEBOUNCE, jobs = 0, mmap_files = 0, depth = 0;
+	const char * pin, * label, * cache_dir = 0, * files_from = 0;
 #ifdef CTAPI
 	void* mutex;
 #endif
 
+	/* Parse options */
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-a") == 0)
+			usealt = 1;
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			cache_dir = argv[++i];
+		else if (strcmp(argv[i], "--watch") == 0)
+			watch = 1;
+		else if (strcmp(argv[i], "--debounce") == 0 && i + 1 < argc)
+			debounce = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--files-from") == 0 && i + 1 < argc)
+			files_from = argv[++i];
+		else if (strcmp(argv[i], "--from-stdin") == 0)
+			files_from = "-";
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+			jobs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--mmap") == 0)
+			mmap_files = 1;
+		else if (strcmp(argv[i], "--uring") == 0 && i + 1 < argc)
+			depth = atoi(argv[++i]);
+		else
+			break;
+	}
+
 	/* Check args */
-	if (argc < 4) {
-		fprintf(stderr, "Usage: [-a] pin label path...\n");
+	if (argc - i < (files_from ? 2 : 3) || (i < argc && argv[i][0] == '-')) {
+		fprintf(stderr, "Usage: [-a] [-c dir] [--files-from file] [--jobs n] [--mmap] [--uring depth] [--watch [--debounce ms]] pin label path...\n");
 		fprintf(stderr, "Signs the specified file(s) and/or files within the specified directory(ies).\n");
-		fprintf(stderr, "  -a  use :p7s instead of .p7s extension (alternate data stream on Windows)\n");
+		fprintf(stderr, "  -a      use :p7s instead of .p7s extension (alternate data stream on Windows)\n");
+		fprintf(stderr, "  -c dir  keep the signing template in dir for the next run\n");
+		fprintf(stderr, "  --files-from file\n");
+		fprintf(stderr, "          also sign the NUL-separated files in file (find -type f -print0), - for stdin\n");
+		fprintf(stderr, "  --from-stdin\n");
+		fprintf(stderr, "          same as --files-from -\n");
+		fprintf(stderr, "  --jobs n\n");
+		fprintf(stderr, "          hash n files in parallel while signing and writing in own threads\n");
+		fprintf(stderr, "  --mmap  hash large files from a memory mapping instead of reading them (Linux)\n");
+		fprintf(stderr, "  --uring depth\n");
+		fprintf(stderr, "          read depth files at once with io_uring (Linux, built with IO_URING)\n");
+		fprintf(stderr, "  --watch keep running and sign files again when they change (Linux)\n");
+		fprintf(stderr, "  --debounce ms\n");
+		fprintf(stderr, "          time a changed file must stay unchanged before it is signed (default %d)\n", WATCH_DEBOUNCE);
 		return 1;
 	}
-	usealt  = strcmp(argv[1], "-a") == 0;
-	pin     = !usealt ? argv[1] : argv[2];
-	label   = !usealt ? argv[2] : argv[3];
+	pin     = argv[i++];
+	label   = argv[i++];
 	sig_ext = !usealt ? ".p7s"  : ":p7s";
 
 	/* Disable buffering on stdout/stderr to prevent mixing the order of
@@ -445,6 +1530,12 @@ int main(int argc, char** argv)
 	/* Log the args */
 	log_inf("pin=****; label='%s'", label);
 
+	if (cache_dir) {
+		log_inf("cache_dir='%s'", cache_dir);
+		if (set_template_cache_dir(cache_dir) < 0)
+			log_wrn("template cache directory '%s' ignored", cache_dir);
+	}
+
 #ifdef CTAPI
 	/* Create a mutex/sem/lock for controlling access to token.
 	   CTAPI implementations must NOT allow simultaneous access to token. */
@@ -456,9 +1547,48 @@ int main(int argc, char** argv)
 	}
 #endif
 
+#ifndef __linux__
+	if (watch) {
+		log_err("--watch is only supported on Linux");
+		return 1;
+	}
+#endif
+
+	if (mmap_files) {
+#ifdef __linux__
+		/* A file shrinking while mapped raises SIGBUS, see hash_mapped */
+		signal(SIGBUS, on_sigbus);
+		use_mmap = 1;
+#else
+		log_wrn("--mmap is only supported on Linux, ignored");
+#endif
+	}
+
+	/* Overlap hashing, signing and writing */
+	if (jobs > 0 && pipeline_start(jobs, pin, label, cache_dir))
+		log_wrn("pipeline not started, signing one file after the other");
+
+	/* Keep many reads in flight */
+	if (depth > 0) {
+		if (uring_init(depth)) {
+			log_wrn("io_uring not available, reading with stdio");
+		} else {
+			log_inf("io_uring with %d file(s) in flight", depth);
+			uring.pin = pin;
+			uring.label = label;
+			uring.active = 1;
+		}
+	}
+
+	/* Sign the listed paths in the same token session */
+	if (files_from) {
+		log_inf("files_from='%s'", files_from);
+		sign_list(files_from, pin, label);
+	}
+
 	/* For each path arg, sign either the specified file
 	   or all the files in the specified directory */
-	for (i = !usealt ? 3 : 4; i < argc; i++) {
+	for (first = i; i < argc; i++) {
 		int err;
 		struct stat info;
 		char* path = argv[i];
@@ -479,13 +1609,34 @@ int main(int argc, char** argv)
 			continue;
 		}
 
+		if (watch) /* Signed by watch_paths */
+			continue;
+
 		if (S_ISDIR(info.st_mode)) /* DIRECTORY */
 			sign_files(path, pin, label); /* Sign all files in the specified directory */
 		else /* FILE */
 			sign_file(path, pin, label);  /* Sign the specified file */
 	}
 
+#ifdef __linux__
+	/* Keep signing the paths as they change */
+	if (watch)
+		watch_paths(argv + first, argc - first, pin, label, debounce);
+#endif
+
+	/* Wait for the files still being read */
+	if (uring.active) {
+		uring_drain();
+		uring_exit();
+		uring.active = 0;
+	}
+
+	/* Wait for the files still in the pipeline */
+	if (pipeline.jobs)
+		pipeline_finish();
+
 	/* Clean up */
+	free(batch_buf);
 	release_template();
 
 #ifdef CTAPI
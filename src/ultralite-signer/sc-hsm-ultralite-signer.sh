@@ -29,9 +29,12 @@
 # ./sc-hsm-ultralite-signer.sh 123456 sign0 /data
 # 
 # If today's date is 2013-10-01, the following commands will be executed...
-# ./sc-hsm-ultralite-signer 123456 sign0 d:\data\2013-10\xxxx-2013-10-01.dat
-# ./sc-hsm-ultralite-signer 123456 sign0 d:\data\2013-10\xxxx-2013-10-01.log
-# ./sc-hsm-ultralite-signer 123456 sign0 d:\data\2013-09\xxxx-2013-09-30.dat
+# ./sc-hsm-ultralite-signer -c ~/.sc-hsm-ultralite 123456 sign0 d:\data\2013-10\xxxx-2013-10-01.dat
+# ./sc-hsm-ultralite-signer -c ~/.sc-hsm-ultralite 123456 sign0 d:\data\2013-10\xxxx-2013-10-01.log
+# ./sc-hsm-ultralite-signer -c ~/.sc-hsm-ultralite 123456 sign0 d:\data\2013-09\xxxx-2013-09-30.dat
+#
+# The signing template is kept in ~/.sc-hsm-ultralite between the runs, so
+# only the first run reads it from the token.
 
 # Verify arg count
 if [[ $# -ne 3 ]]; then
@@ -45,6 +48,10 @@ PIN=${1}
 LABEL=${2}
 BASE_PATH=${3%/} # strip trailing '/'
 
+# Private directory for the template cache (-c)
+CACHE_DIR=${HOME}/.sc-hsm-ultralite
+mkdir -p -m 700 ${CACHE_DIR}
+
 # Calculate path to current & previous month folder in format "YYYY-mm"
     CUR_DAY=$(date                            +%Y-%m-%d)
 CUR_DAY_MTH=$(date --date="${CUR_DAY}"        +%Y-%m)
@@ -53,11 +60,11 @@ PRV_DAY_MTH=$(date --date="${PRV_DAY}"        +%Y-%m)
 
 # Run sc-hsm-ultralite-signer
 # if [ -d ${BASE_PATH} ]; then
-#    find ${BASE_PATH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s -or -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${PIN} ${LABEL} '{}' ';'
+#    find ${BASE_PATH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s -or -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} -c ${CACHE_DIR} ${PIN} ${LABEL} '{}' ';'
 # fi
 if [ -d ${BASE_PATH}/${CUR_DAY_MTH} ]; then
-    find ${BASE_PATH}/${CUR_DAY_MTH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${PIN} ${LABEL} '{}' ';'
+    find ${BASE_PATH}/${CUR_DAY_MTH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s \) -exec ${EXE} -c ${CACHE_DIR} ${PIN} ${LABEL} '{}' ';'
 fi
 if [ -d ${BASE_PATH}/${PRV_DAY_MTH} ]; then
-    find ${BASE_PATH}/${PRV_DAY_MTH} -maxdepth 1 -type f \( -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${PIN} ${LABEL} '{}' ';'
+    find ${BASE_PATH}/${PRV_DAY_MTH} -maxdepth 1 -type f \( -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} -c ${CACHE_DIR} ${PIN} ${LABEL} '{}' ';'
 fi
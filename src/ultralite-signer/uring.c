@@ -0,0 +1,468 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file uring.c
+ * @brief io_uring read engine hashing many files with several reads in flight
+ *
+ * Each file in flight owns a slot with a registered buffer and a direct
+ * descriptor (fixed file) of the same index, so the open, the reads and
+ * the close of a file are linked without the descriptor ever reaching
+ * user space. The files are read in chunks of URING_CHUNK bytes, one
+ * read per file at a time so the chunks are hashed in order as they
+ * complete. Uses the system calls directly, liburing is not required.
+ * Not thread-safe, all calls are expected from the same thread.
+ */
+
+#if defined(__linux__) && defined(IO_URING)
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <ultralite/log.h>
+#include "uring.h"
+
+/* Operations of a slot, the low 16 bits of user_data hold the slot */
+#define OP_OPEN  1
+#define OP_READ  2
+#define OP_CLOSE 3
+
+/**
+ * Structure for a file in flight.
+ */
+typedef struct
+{
+	char* path;             /* 0 if the slot is free */
+	long long off;          /* next read offset */
+	long long end;          /* hash up to here, the size at the start */
+	int skip;               /* bytes read before the first byte to hash */
+	int inflight;           /* requests submitted and not completed */
+	int opened;             /* the direct descriptor is installed */
+	int failed;
+	sha256_context ctx;
+	uring_done_t done;
+	void* user;
+} slot_t;
+
+static struct
+{
+	int fd;
+	unsigned int depth;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ptr;
+	size_t sq_size;
+	void* cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned int tail;      /* next SQ tail, published by submit */
+	unsigned int to_submit; /* SQEs not yet consumed by io_uring_enter */
+	unsigned char* bufs;    /* depth * URING_CHUNK */
+	slot_t* slots;
+	unsigned int busy;      /* slots in use */
+} ring = { -1 };
+
+static int sys_setup(unsigned int entries, struct io_uring_params* p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int sys_register(unsigned int opcode, const void* arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+/**
+ * Determine if the kernel supports the operations used here. Direct
+ * descriptors for open and close came with kernel 5.15, which is also
+ * the first one with IORING_OP_LINKAT.
+ */
+static int supported(void)
+{
+	static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_CLOSE, IORING_OP_LINKAT };
+	struct io_uring_probe* probe;
+	int i, ok;
+
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return 0;
+	ok = sys_register(IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+		ok = ops[i] <= probe->last_op && probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED;
+	free(probe);
+	return ok;
+}
+
+/**
+ * Map the rings, register one buffer and one fixed file per slot.
+ * Returns 0 on success.
+ */
+static int setup(unsigned int depth)
+{
+	struct io_uring_params p;
+	struct iovec* iov;
+	int* fds;
+	unsigned int i;
+	int err;
+
+	/* open, read and close of every slot fit at once */
+	ring.depth = depth;
+	memset(&p, 0, sizeof(p));
+	ring.fd = sys_setup(depth * 4, &p);
+	if (ring.fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !supported())
+		return -1;
+
+	ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring.cq_size > ring.sq_size)
+		ring.sq_size = ring.cq_size;
+	ring.sq_ptr = mmap(0, ring.sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED) {
+		ring.sq_ptr = 0;
+		return -1;
+	}
+	ring.cq_ptr = ring.sq_ptr; /* IORING_FEAT_SINGLE_MMAP */
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(0, ring.sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = 0;
+		return -1;
+	}
+	ring.tail = *(unsigned int*)((char*)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_head = (unsigned int*)((char*)ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail = (unsigned int*)((char*)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned int*)((char*)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int*)((char*)ring.sq_ptr + p.sq_off.array);
+	ring.cq_head = (unsigned int*)((char*)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned int*)((char*)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned int*)((char*)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)((char*)ring.cq_ptr + p.cq_off.cqes);
+
+	/* Buffers read into without a per-request page lookup */
+	ring.bufs = mmap(0, (size_t)depth * URING_CHUNK, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.bufs == MAP_FAILED) {
+		ring.bufs = 0;
+		return -1;
+	}
+	iov = malloc(depth * sizeof(struct iovec));
+	fds = malloc(depth * sizeof(int));
+	if (!iov || !fds) {
+		free(iov);
+		free(fds);
+		return -1;
+	}
+	for (i = 0; i < depth; i++) {
+		iov[i].iov_base = ring.bufs + (size_t)i * URING_CHUNK;
+		iov[i].iov_len = URING_CHUNK;
+		fds[i] = -1; /* sparse, filled by the direct opens */
+	}
+	err = sys_register(IORING_REGISTER_BUFFERS, iov, depth)
+		|| sys_register(IORING_REGISTER_FILES, fds, depth);
+	free(iov);
+	free(fds);
+	if (err)
+		return -1;
+
+	ring.slots = calloc(depth, sizeof(slot_t));
+	if (!ring.slots)
+		return -1;
+	return 0;
+}
+
+/**
+ * Start the engine with depth files in flight. Returns 0 on success or
+ * -1 if io_uring is not available, e.g. an old kernel or disabled by
+ * the system; the caller falls back to stdio then.
+ */
+int uring_init(unsigned int depth)
+{
+	if (depth == 0 || depth > 0xFFFF)
+		return -1;
+	if (setup(depth)) {
+		int e = errno;
+		uring_exit();
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Get the next SQE, the ring holds all requests of all slots.
+ */
+static struct io_uring_sqe* get_sqe(unsigned int slot, int op)
+{
+	unsigned int index = ring.tail++ & *ring.sq_mask;
+	struct io_uring_sqe* sqe = &ring.sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (unsigned long long)op << 16 | slot;
+	ring.sq_array[index] = index;
+	ring.to_submit++;
+	ring.slots[slot].inflight++;
+	return sqe;
+}
+
+/**
+ * Queue the read of the next chunk of the slot, linked to the close if
+ * it is the last one.
+ */
+static void queue_read(unsigned int slot, unsigned char flags)
+{
+	slot_t* s = &ring.slots[slot];
+	struct io_uring_sqe* sqe = get_sqe(slot, OP_READ);
+	long long len = s->end - s->off;
+
+	if (len > URING_CHUNK)
+		len = URING_CHUNK;
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE | flags;
+	sqe->fd = slot;
+	sqe->off = s->off;
+	sqe->addr = (unsigned long long)(ring.bufs + (size_t)slot * URING_CHUNK);
+	sqe->len = (unsigned int)len;
+	sqe->buf_index = slot;
+	if (s->off + len >= s->end) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = get_sqe(slot, OP_CLOSE);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = slot + 1;
+	}
+}
+
+static void queue_close(unsigned int slot)
+{
+	struct io_uring_sqe* sqe = get_sqe(slot, OP_CLOSE);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = slot + 1;
+}
+
+/**
+ * Submit the queued SQEs and wait for at least wait completions.
+ */
+static int submit(unsigned int wait)
+{
+	int n;
+
+	__atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+	for (;;) {
+		n = sys_enter(ring.to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		if (n >= 0 || errno != EINTR)
+			break;
+	}
+	if (n < 0) {
+		int e = errno;
+		log_err("error submitting to io_uring: %s", strerror(e));
+		return -1;
+	}
+	ring.to_submit -= n;
+	return 0;
+}
+
+/**
+ * Process the completion of a request of the slot and move the file on:
+ * hash the chunk read, read the next one or close the file. Reports the
+ * file and frees the slot when the last request completed.
+ */
+static void complete(unsigned int slot, int op, int res)
+{
+	slot_t* s = &ring.slots[slot];
+
+	s->inflight--;
+	switch (op) {
+	case OP_OPEN:
+		if (res < 0) {
+			log_err("error opening file '%s' for reading: %s", s->path, strerror(-res));
+			s->failed = 1;
+		} else {
+			s->opened = 1;
+		}
+		break;
+	case OP_READ:
+		if (res == -ECANCELED) /* open failed */
+			break;
+		if (res < 0) {
+			log_err("error reading file '%s': %s", s->path, strerror(-res));
+			s->failed = 1;
+		} else if (res == 0 && s->off < s->end) {
+			/* End of file before the size checked */
+			log_err("error reading file '%s': shrunk while hashing", s->path);
+			s->failed = 1;
+		} else {
+			/*
+			 * A short read is legal, e.g. on a network file system, the
+			 * rest is read again. It cancelled the close linked to the
+			 * last read, queue_read links the close to the new one.
+			 */
+			sha256_update(&s->ctx, ring.bufs + (size_t)slot * URING_CHUNK + s->skip, res - s->skip);
+			s->skip = 0;
+			s->off += res;
+			if (s->off < s->end)
+				queue_read(slot, 0);
+		}
+		break;
+	case OP_CLOSE:
+		if (res >= 0)
+			s->opened = 0;
+		else if (res != -ECANCELED)
+			log_err("error closing file '%s': %s", s->path, strerror(-res));
+		break;
+	}
+	if (s->inflight)
+		return;
+	/* A failed read cancels the linked close */
+	if (s->opened) {
+		queue_close(slot);
+		s->opened = 0;
+		return;
+	}
+	s->done(s->user, s->failed ? 0 : &s->ctx);
+	free(s->path);
+	s->path = 0;
+	ring.busy--;
+}
+
+/**
+ * Submit the queued requests and process the completions, waiting for
+ * at least one if wait is set.
+ */
+static void reap(int wait)
+{
+	unsigned int head, tail;
+
+	if (submit(wait ? 1 : 0)) {
+		/* Can't go on, drop the files in flight */
+		unsigned int i;
+		for (i = 0; i < ring.depth; i++) {
+			if (ring.slots[i].path) {
+				ring.slots[i].done(ring.slots[i].user, 0);
+				free(ring.slots[i].path);
+				ring.slots[i].path = 0;
+			}
+		}
+		ring.busy = 0;
+		ring.to_submit = 0;
+		return;
+	}
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+		unsigned long long data = cqe->user_data;
+		int res = cqe->res;
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		complete((unsigned int)(data & 0xFFFF), (int)(data >> 16), res);
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+/**
+ * Continue the hash ctx of the file at the specified path from pos to
+ * end, the file size when checked. Like open_data, the byte before pos
+ * must still exist. Waits while all slots are in use; done is called
+ * from here or a later uring_hash or uring_drain.
+ */
+void uring_hash(const char* path, long long pos, long long end,
+	sha256_context* ctx, uring_done_t done, void* user)
+{
+	struct io_uring_sqe* sqe;
+	unsigned int i;
+	slot_t* s;
+
+	while (ring.busy == ring.depth)
+		reap(1);
+	for (i = 0; ring.slots[i].path; i++)
+		;
+	s = &ring.slots[i];
+	s->path = strdup(path);
+	if (!s->path) {
+		log_err("out of memory, '%s' not signed", path);
+		done(user, 0);
+		return;
+	}
+	s->skip = pos > 0;
+	s->off = pos - s->skip;
+	s->end = end > pos ? end : pos; /* a file shorter than pos fails as shrunk */
+	s->failed = 0;
+	s->opened = 0;
+	s->inflight = 0;
+	s->ctx = *ctx;
+	s->done = done;
+	s->user = user;
+	ring.busy++;
+
+	sqe = get_sqe(i, OP_OPEN);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long long)s->path;
+	sqe->open_flags = O_RDONLY; /* no O_CLOEXEC, there is no descriptor to inherit */
+	sqe->file_index = i + 1; /* direct descriptor in slot i */
+	queue_read(i, 0);
+
+	/* Submit without waiting, completions are picked up meanwhile */
+	reap(0);
+}
+
+/**
+ * Wait until all files passed to uring_hash are done.
+ */
+void uring_drain(void)
+{
+	while (ring.busy)
+		reap(1);
+}
+
+/**
+ * Stop the engine after uring_drain.
+ */
+void uring_exit(void)
+{
+	free(ring.slots);
+	ring.slots = 0;
+	if (ring.bufs)
+		munmap(ring.bufs, (size_t)ring.depth * URING_CHUNK);
+	ring.bufs = 0;
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_size);
+	ring.sqes = 0;
+	if (ring.sq_ptr)
+		munmap(ring.sq_ptr, ring.sq_size);
+	ring.sq_ptr = 0;
+	if (ring.fd >= 0)
+		close(ring.fd);
+	ring.fd = -1;
+	ring.depth = 0;
+}
+
+#endif /* __linux__ && IO_URING */
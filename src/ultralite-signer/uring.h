@@ -0,0 +1,51 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file uring.h
+ * @brief io_uring read engine hashing many files with several reads in flight
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <ultralite/sc-hsm-ultralite.h>
+
+/* Bytes read per request, one registered buffer of this size per file in flight */
+#define URING_CHUNK 0x20000
+
+/**
+ * Called with the hash context when the file passed to uring_hash has
+ * been hashed, or with ctx 0 if it couldn't be read (already logged).
+ */
+typedef void (*uring_done_t)(void* user, sha256_context* ctx);
+
+#if defined(__linux__) && defined(IO_URING)
+
+int uring_init(unsigned int depth);
+
+void uring_hash(const char* path, long long pos, long long end,
+	sha256_context* ctx, uring_done_t done, void* user);
+
+void uring_drain(void);
+
+void uring_exit(void);
+
+#else /* stdio only */
+
+/* The arguments are evaluated, so the callers' helpers count as used */
+#define uring_init(depth) ((void)(depth), -1)
+#define uring_hash(path, pos, end, ctx, done, user) \
+	((void)(path), (void)(pos), (void)(end), (void)(ctx), (void)(done), (void)(user))
+#define uring_drain() ((void)0)
+#define uring_exit() ((void)0)
+
+#endif
+
+#endif /* _URING_H_ */
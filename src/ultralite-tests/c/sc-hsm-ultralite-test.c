@@ -44,6 +44,49 @@ long GetTickCount()
 }
 #endif
 
+#ifdef UL_ARENA
+/* token connection, APDU buffer and the cached templates (about 2.5k each) */
+static unsigned char arena[16384];
+#endif
+
+/* upper bound in ms of the latency bucket holding the given fraction of the calls */
+static double Percentile(const ul_ins_stats_t *s, double fraction)
+{
+	unsigned long long sum = 0;
+	int i;
+	for (i = 0; i < UL_STATS_BUCKETS - 1; i++) {
+		sum += s->hist[i];
+		if (sum >= fraction * s->calls)
+			break;
+	}
+	return (2ULL << i) / 1000.0;
+}
+
+static void PrintStats()
+{
+	static const char *names[UL_STATS_INS] = { "SELECT", "VERIFY", "READ", "SIGN", "ENUMERATE", "OTHER" };
+	ul_stats_t stats;
+	int i;
+	ul_get_stats(&stats);
+	log_inf("%-9s %8s %6s %10s %10s %9s %9s %9s", "APDU", "calls", "errors", "bytes out", "bytes in", "avg ms", "p50 ms <", "p99 ms <");
+	for (i = 0; i < UL_STATS_INS; i++) {
+		const ul_ins_stats_t *s = &stats.ins[i];
+		if (s->calls == 0)
+			continue;
+		log_inf("%-9s %8llu %6llu %10llu %10llu %9.3f %9.3f %9.3f", names[i],
+			s->calls, s->errors, s->bytes_out, s->bytes_in,
+			s->time_us / 1000.0 / s->calls, Percentile(s, 0.5), Percentile(s, 0.99));
+	}
+	log_inf("connections: %llu, card resets: %llu", stats.opens, stats.resets);
+#ifdef UL_ARENA
+	{
+		int used, peak;
+		ul_arena_usage(&used, &peak);
+		log_inf("arena: %d of %d bytes used, peak %d", used, (int)sizeof(arena), peak);
+	}
+#endif
+}
+
 int main(int argc, char **argv)
 {
 	int i, rv;
@@ -73,6 +116,10 @@ int main(int argc, char **argv)
 	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
 
+#ifdef UL_ARENA
+	ul_set_arena(arena, sizeof(arena));
+#endif
+
 	/* Create a SHA-256 hash of this executable */
 	sha256_starts(&ctx);
 	fp = fopen(argv[0], "rb");
@@ -134,6 +181,7 @@ int main(int argc, char **argv)
 		}
 		fclose(fp);
 	}
+	PrintStats();
 	release_template();
 
 	return rv;
@@ -22,6 +22,8 @@
 #include <crtdbg.h>
 #endif
 
+static Card_t *Card; /* token connection of the current action */
+
 int Hex2Bin(const char* hex, int len, uint8* bin)
 {
 	int i;
@@ -54,16 +56,16 @@ int Hex2Bin(const char* hex, int len, uint8* bin)
 int GetPinStatus()
 {
 	uint16 sw1sw2;
-	int rc = SC_Open(0, 0);
+	int rc = SC_Open(&Card, 0, 0);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: VERIFY */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x00,0x20,0x00,0x81,
 		NULL, 0,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(Card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
@@ -105,37 +107,37 @@ int InitializeToken(const char *pin, const char *sopin, int dkeksCount, uint8 *d
 		*p++ = 0x92; *p++ = 0x01; *p++ = dkeksCount;
 	}
 
-	rc = SC_Open(0, 0);
+	rc = SC_Open(&Card, 0, 0);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: INITIALIZE DEVICE */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x80,0x50,0x00,0x00,
 		data, (int)(p - data),
 		NULL, 0,
 		&sw1sw2);
 	if (rc < 0) {
-		SC_Close();
+		SC_Close(Card);
 		return rc;
 	}
 	if (sw1sw2 != 0x9000) {
-		SC_Close();
+		SC_Close(Card);
 		return sw1sw2;
 	}
 	for (i = 0, p = dkeks; i < dkeksCount; i++, p += 0x20) {
 		uint8 buf[10];
 		/* - SmartCard-HSM: IMPORT DKEK SHARE */
-		rc = SC_ProcessAPDU(
+		rc = SC_ProcessAPDU(Card,
 			0, 0x80,0x52,0x00,0x00,
 			p, 0x20,
 			buf, 10,
 			&sw1sw2);
 		if (rc < 0) {
-			SC_Close();
+			SC_Close(Card);
 			return rc;
 		}
 		if (sw1sw2 != 0x9000) {
-			SC_Close();
+			SC_Close(Card);
 			return sw1sw2;
 		}
 		printf("total shares: %d, outstanding shares: %d, key check value: %02x%02x%02x%02x%02x%02x%02x%02x\n",
@@ -143,7 +145,7 @@ int InitializeToken(const char *pin, const char *sopin, int dkeksCount, uint8 *d
 			buf[1],
 			buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9]);
 	}
-	SC_Close();
+	SC_Close(Card);
 	return sw1sw2;
 }
 
@@ -159,16 +161,16 @@ int UnlockPin(const char *sopin)
 	rc = Hex2Bin(sopin, 16, so_pin);
 	if (rc)
 		return rc;
-	rc = SC_Open(0, 0);
+	rc = SC_Open(&Card, 0, 0);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: RESET RETRY COUNTER */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x00,0x2C,0x01,0x81,
 		so_pin, 8,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(Card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
@@ -196,16 +198,16 @@ int SetPin(const char *pin, const char *sopin)
 			return rc;
 	}
 	memcpy(so_pin_pin + 8, pin, pin_len); /* no 0 terminator */
-	rc = SC_Open(0, 0);
+	rc = SC_Open(&Card, 0, 0);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: RESET RETRY COUNTER */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x00,0x2C,0x00,0x81,
 		so_pin_pin, 8 + pin_len,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(Card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
@@ -228,16 +230,16 @@ int ChangePin(const char *oldpin, const char *newpin)
 	}
 	memcpy(pins,           oldpin, old_len); /* no 0 terminator */
 	memcpy(pins + old_len, newpin, new_len); /* no 0 terminator */
-	rc = SC_Open(0, 0);
+	rc = SC_Open(&Card, 0, 0);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: CHANGE REFERENCE DATA */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x00,0x24,0x00,0x81,
 		pins, old_len + new_len,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(Card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
@@ -262,16 +264,16 @@ int ChangeSoPin(const char *oldsopin, const char *newsopin)
 	rc = Hex2Bin(newsopin, 16, so_pin_so_pin + 8);
 	if (rc)
 		return rc;
-	rc = SC_Open(0, 0);
+	rc = SC_Open(&Card, 0, 0);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: CHANGE REFERENCE DATA */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x00,0x24,0x00,0x88,
 		so_pin_so_pin, 8 + 8,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(Card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
@@ -286,16 +288,16 @@ int WrapKey(const char *pin, int keyid, const char* filename)
 		printf("keyid (%d) must be between 1 and 127\n", keyid);
 		return ERR_INVALID;
 	}
-	rc = SC_Open(pin, 0);
+	rc = SC_Open(&Card, pin, 0);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: WRAP KEY */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x80,0x72,keyid,0x92,
 		NULL, 0,
 		wrapped, sizeof(wrapped),
 		&sw1sw2);
-	SC_Close();
+	SC_Close(Card);
 	if (rc <= 0)
 		return rc;
 	SaveToFile(filename, wrapped, rc);
@@ -307,7 +309,7 @@ int UnwrapKey(const char *pin, int keyid, const char* filename)
 	uint16 sw1sw2;
 	uint8 *pWrapped;
 	int len;
-	int rc = SC_Open(pin, 0);
+	int rc = SC_Open(&Card, pin, 0);
 	if (rc < 0)
 		return rc;
 	if (!(1 <= keyid && keyid <= 127)) {
@@ -325,13 +327,13 @@ int UnwrapKey(const char *pin, int keyid, const char* filename)
 		return ERR_INVALID;
 	}
 	/* - SmartCard-HSM: UNWRAP KEY */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x80,0x74,keyid,0x93,
 		pWrapped, len,
 		NULL, 0,
 		&sw1sw2);
 	free(pWrapped);
-	SC_Close();
+	SC_Close(Card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
@@ -342,48 +344,38 @@ int DumpAllFiles(const char *pin)
 	uint8 list[2 * 128];
 	uint16 sw1sw2;
 	int rc, i;
-	rc = SC_Open(pin, 0);
+	rc = SC_Open(&Card, pin, 0);
 	if (rc < 0)
 		return rc;
 
 	/* - SmartCard-HSM: ENUMERATE OBJECTS */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(Card,
 		0, 0x80,0x58,0x00,0x00,
 		NULL, 0,
 		list, sizeof(list),
 		&sw1sw2);
 	if (rc < 0) {
-		SC_Close();
+		SC_Close(Card);
 		return rc;
 	}
 	/* save dir and all files */
 	printf("write 'dir.hsm'\n");
 	SaveToFile("dir.hsm", list, rc);
 	for (i = 0; i < rc; i += 2) {
-		uint8 buf[8192], *p;
+		uint8 buf[8192];
 		char name[10];
-		int rc, off;
+		int rc;
 		uint16 fid = list[i] << 8 | list[i + 1];
 		if (list[i] == 0xcc) /* never readable */
 			continue;
-		for (p = buf, off = 0; off < sizeof(buf); p += rc) {
-			int l = sizeof(buf) - off;
-			if (l > MAX_OUT_IN)
-				l = MAX_OUT_IN;
-			rc = SC_ReadFile(fid, off, p, l);
-			if (rc < 0)
-				break;
-			off += rc;
-			if (rc < l)
-				break;
-		}
+		rc = SC_ReadFile(Card, fid, 0, buf, sizeof(buf));
 		if (rc >= 0) {
 			sprintf(name, "%04X.asn", fid);
 			printf("write '%s'\n", name);
-			SaveToFile(name, buf, off);
+			SaveToFile(name, buf, rc);
 		}
 	}
-	SC_Close();
+	SC_Close(Card);
 	return 0;
 }
 
@@ -427,12 +419,12 @@ int main(int argc, char **argv)
 		return Usage();
 
 	if (strcmp(argv[1], "--restore-files") == 0) {
-		int rc = SC_Open(argv[2], 0);
+		int rc = SC_Open(&Card, argv[2], 0);
 		if (rc < 0)
 			return rc;
 		for (i = 3; i < argc; i++) {
 			const char *name = argv[i];
-			int dataLen, off;
+			int dataLen;
 			uint8 *pData;
 			uint8 afid[2];
 			uint16 fid;
@@ -455,16 +447,7 @@ int main(int argc, char **argv)
 				printf("file '%s' empty\n", name);
 				continue;
 			}
-			rc = 0;
-			for (off = 0; off < dataLen;) {
-				int len = dataLen - off;
-				if (len > MAX_OUT_IN - 6)
-					len = MAX_OUT_IN - 6;
-				rc = SC_WriteFile(fid, off, pData + off, len);
-				if (rc < 0)
-					break;
-				off += len;
-			}
+			rc = SC_WriteFile(Card, fid, 0, pData, dataLen);
 			free(pData);
 			if (rc < 0) {
 				printf("write error %d file '%s'\n", rc, name);
@@ -472,7 +455,7 @@ int main(int argc, char **argv)
 			}
 			printf("file '%s' successfully restored\n", name);
 		}
-		SC_Close();
+		SC_Close(Card);
 		return 0;
 	}
 	if (strcmp(argv[1], "--init-token") == 0) {
@@ -0,0 +1,140 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file arena.c
+ * @brief Internal use only. Allocator of the UL_ARENA profile, serves
+ *        ul_malloc, ul_calloc and ul_free from a caller provided arena.
+ */
+
+#ifdef UL_ARENA
+
+#include <string.h>
+
+#include "utils.h"
+#include "sc-hsm-ultralite.h"
+
+/*
+	The arena is a sequence of blocks, each starting with a header. A
+	block is used or free, adjacent free blocks are merged by ul_free.
+	Allocations are first fit, the library holds few blocks at a time
+	(context, card, APDU buffer, label index and the cached templates).
+	Not thread safe, the UL_ARENA profile has no pool and no worker threads.
+*/
+
+typedef struct {
+	size_t Size; /* including the header, multiple of sizeof(Block_t) */
+	size_t Used;
+} Block_t;
+
+static uint8 *Arena;
+static size_t ArenaSize;
+static size_t Used, Peak;
+
+#define NEXT(b) ((Block_t*)((uint8*)(b) + (b)->Size))
+#define END     ((Block_t*)(Arena + ArenaSize))
+
+/*
+ *  Set the memory of all allocations of the library, e.g. a static array.
+ *  Call before the first ul_open or sign_hash and again only after all
+ *  contexts are closed and release_template was called.
+ *
+ *  mem         : arena
+ *  size        : size of mem in bytes
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC ul_set_arena(void *mem, int size)
+{
+	size_t skew = (size_t)mem % sizeof(Block_t);
+	Block_t *b;
+	if (Used != 0)
+		return ERR_INVALID;
+	if (skew) {
+		mem = (uint8*)mem + sizeof(Block_t) - skew;
+		size -= sizeof(Block_t) - skew;
+	}
+	if (mem == 0 || size < 2 * (int)sizeof(Block_t)) {
+		Arena = 0;
+		ArenaSize = 0;
+		return mem == 0 ? 0 : ERR_MEMORY;
+	}
+	Arena = (uint8*)mem;
+	ArenaSize = size - size % sizeof(Block_t);
+	Peak = 0;
+	b = (Block_t*)Arena;
+	b->Size = ArenaSize;
+	b->Used = 0;
+	return 0;
+}
+
+/*
+ *  Bytes of the arena in use now and at most since ul_set_arena, headers
+ *  included
+ */
+void EXPORT_FUNC ul_arena_usage(int *used, int *peak)
+{
+	if (used)
+		*used = (int)Used;
+	if (peak)
+		*peak = (int)Peak;
+}
+
+void *ul_malloc(size_t size)
+{
+	size_t need = (size + 2 * sizeof(Block_t) - 1) / sizeof(Block_t) * sizeof(Block_t);
+	Block_t *b;
+	if (Arena == 0 || need < size)
+		return 0;
+	for (b = (Block_t*)Arena; b < END; b = NEXT(b)) {
+		if (b->Used || b->Size < need)
+			continue;
+		if (b->Size - need >= 2 * sizeof(Block_t)) { /* split */
+			Block_t *rest = (Block_t*)((uint8*)b + need);
+			rest->Size = b->Size - need;
+			rest->Used = 0;
+			b->Size = need;
+		}
+		b->Used = 1;
+		Used += b->Size;
+		if (Used > Peak)
+			Peak = Used;
+		return b + 1;
+	}
+	return 0;
+}
+
+void *ul_calloc(size_t n, size_t size)
+{
+	void *p;
+	if (size && n > (size_t)-1 / size)
+		return 0;
+	p = ul_malloc(n * size);
+	if (p)
+		memset(p, 0, n * size);
+	return p;
+}
+
+void ul_free(void *p)
+{
+	Block_t *b, *next;
+	if (p == 0)
+		return;
+	b = (Block_t*)p - 1;
+	b->Used = 0;
+	Used -= b->Size;
+	for (b = (Block_t*)Arena; b < END; b = NEXT(b)) {
+		if (b->Used)
+			continue;
+		for (next = NEXT(b); next < END && !next->Used; next = NEXT(b))
+			b->Size += next->Size;
+	}
+}
+
+#endif /* UL_ARENA */
@@ -10,8 +10,8 @@
  *
  * @file sc-hsm-ultralite.c
  * @author Christoph Brunhuber
- * @brief Functions for RSA-2k signing of SHA-256
- *                  ECDSA-prime256 signing of SHA-256
+ * @brief Functions for RSA-2k signing of SHA-256/384/512
+ *                  ECDSA-prime256 signing of SHA-256/384/512
  *                  Card Devices, Version 1.0
  */
 
@@ -20,8 +20,11 @@
 #include <string.h>
 #include <time.h>
 
+#include <common/mutex.h>
+
 #include "log.h"
 #include "utils.h"
+#include "thread.h"
 #include "sc-hsm-ultralite.h"
 
 /*
@@ -39,7 +42,8 @@
 	Specifically the MessageDigest, the SigningTime and the Signature itself are the dynamic
 	fields, all other fields are static. Because a RSA signature from the same key always has
 	the same size, the CMS signature file can be produced from a template by simply patching the 3
-	fields. The needed cryptographic ciphers are, hashing (here SHA256) and the RSA private key
+	fields. The needed cryptographic ciphers are, hashing (SHA-256, SHA-384 or SHA-512 as given by the
+	template's HashLen) and the RSA private key
 	operation. The RSA operation is actually running on the token (no crypto code required).
 	In this specific case the raw RSA private key operation is used, so the PKCS#1.5 padding is also
 	implemented here (trivial).
@@ -49,6 +53,10 @@
 	The patch plan is the mentioned header. See "typedef struct {..} Template_t" for details.
 	The interface contains actually a single function (sign_hash) which returns the CMS signature file for a
 	given document hash. The program uses ~2k heap memory and ~2k stack memory (not including the USB library).
+	Built with UL_ARENA, the library takes all memory, i.e. the token connection, the APDU buffer and the cached
+	templates, from an arena set with ul_set_arena and limits APDUs to 256 bytes; ul_arena_usage reports the
+	peak. That profile has no pool, no ul_sign_async and no template cache directory. "make report" lists the
+	worst-case stack of each public function from the call graph of the compiler.
 	The template is cached internally for reuse. However it is also robust against a token change.
 	
 	This specific token supports both ECDSA and RSA.  This library also supports ECDSA (prime256v1 == secp256r1),
@@ -66,17 +74,36 @@
 	The template works from the year 2013 until 2049 inclusive. Before the year 2050 the representation of the signing time
 	year is 2 digits, starting with 2050 it uses 4 digits.
 
-	The functions sign_hash and release_template are not thread safe. Further the signature passed back from sign_hash
-	is invalidated by another sign_hash call. In other words, the caller must use the result or copy the result before
+	The functions sign_hash and release_template are not thread safe, they share one default context. Multi-threaded
+	applications use ul_open, ul_sign and ul_close instead: each context owns its token connection and template cache,
+	so each thread can drive its own token. A context must not be used by two threads at the same time.
+	ul_pool_open opens every token holding a label, ul_pool_sign may be called from any number of threads and
+	signs with the least busy token, a hash is signed with another token if one fails or is pulled.
+	Further the signature passed back from sign_hash (ul_sign) is invalidated by another sign_hash (ul_sign) call. In other words, the caller must use the result or copy the result before
 	calling sign_hash again. The sign_hash call and the usage of the signature data must be mutually exclusive.
+	ul_sign_into patches a copy of the template in a caller buffer instead, and ul_sign_iov returns the CMS as iovec
+	of the cached template and the patched fields, so several results can be alive at once.
+	ul_sign_async queues a hash to a worker thread owning the context and returns at once, the caller can hash the
+	next document while the token signs. The CMS is passed to a callback in the worker thread, ul_sign_poll and
+	ul_sign_wait tell whether the queued signatures are done.
+	ul_sign_begin, ul_sign_update and ul_sign_final hash the document in the library. Meanwhile a thread connects
+	the token and validates the template, so the signature costs the hash time and a single SIGN.
 	The function release_template should be called at the very end. Calling release_template is mandatory on an OS where 
 	you do not have isolated processes and the OS does not automatically release task-allocated memory after task
-	termination (e.g. WIN16)
+	termination (e.g. WIN16). It also frees the cache directory set with set_template_cache_dir, the cache
+	size and revalidation settings stay in effect.
 
-	For performance reasons, sign_hash internally caches the last used template. If you need to sign multiple files with
-	different keys (labels) you should sign the files with the first key, then the files with the second key
-	and so on. Otherwise the template has to be loaded from the token for each file. The function sign_hash is robust against
-	token changes.
+	For performance reasons, sign_hash internally caches the most recently used templates (TEMPLATE_CACHE_SIZE,
+	adjustable with set_template_cache_size). Switching between cached keys (labels) costs no template load,
+	only the least recently used template is dropped when the cache is full. The function sign_hash is robust against
+	token changes, by default the cert id of a cached template is compared with the token before each use.
+	This costs one READ BINARY per signature; set_template_revalidation (ul_set_revalidation) limits the check to
+	a time interval or to card/reader events reported by PCSC or CT-API.
+	The token connection stays open between calls, each signature runs in a PCSC transaction. If another process
+	or the reader reset the card, the connection is reestablished and the applet selected and the PIN verified
+	again, without dropping the cached templates.
+	Processes which sign only a few hashes can keep the templates in a directory (set_template_cache_dir,
+	ul_set_cache_dir), a cached template file is also checked with the cert id before use.
 
 	The exposed hash functions are thread safe as long as you use distinct contexts.
 */
@@ -89,8 +116,8 @@
  *******************************************************************************
  ******************************************************************************
 
-/* Warning: case sensitive */
-static int FindLabel(const char *label, const uint8* buf, int len)
+/* Returns the length of the label of a key or data descriptor, the label in *pLabel */
+static int GetLabel(const uint8* buf, int len, const uint8 **pLabel)
 {
 	int val, ix = 0;
 
@@ -111,15 +138,10 @@ static int FindLabel(const char *label, const uint8* buf, int len)
 	ReturnIfTagIsNot(0x0c, 0x0c);
 	if (val >= 0x80)
 		return 0;  /* assume length < 128 */
-	val += ix; /* end of UTF8String */
-	if (val > len)
+	if (ix + val > len)
 		return 0;
-	/* compare passed label with label of file */
-	while (ix < val && *label) {
-		if (*label++ != buf[ix++]) /* case sensitive */
-			return 0;
-	}
-	return ix == val && *label == 0;
+	*pLabel = buf + ix;
+	return val;
 
 #undef ReturnIfTagIsNot
 }
@@ -168,16 +190,89 @@ static int FindFid(uint8 hi, uint8 lo, const uint8* buf, int len)
 	Templates could be also used with PKCS11 without a crypto library.
 	The approach in this library is much simpler, you do not even need a PKCS11 library, here it is managed
 	on a lower level, but specific to the SC-HSM (CardContact) card.
+	The labels read are kept in an index per token connection, so each descriptor is read at most once.
+	A lookup continues the scan where the previous one stopped. The index is dropped as soon as
+	ENUMERATE OBJECTS returns a different list.
 */
-static int GetFids(const char *label, uint16 *pKeyFid, uint16 *pTemplateFid)
+
+typedef struct {
+	uint16 Fid;  /* key 0xCCxx or template 0xCDxx */
+	char *Label;
+} FidEntry_t;
+
+typedef struct {
+	uint8 List[2 * 128]; /* ENUMERATE OBJECTS response the index belongs to */
+	int ListLen;
+	int Next[2];         /* scan position in List for keys [0] and templates [1] */
+	int Count;
+	FidEntry_t Entry[128];
+} FidIndex_t;
+
+static void FreeIndex(FidIndex_t *index)
+{
+	int i;
+	if (index == 0)
+		return;
+	for (i = 0; i < index->Count; i++)
+		ul_free(index->Entry[i].Label);
+	ul_free(index);
+}
+
+/*
+ *  Returns the key (kind 0) or template (kind 1) fid with the label, 0 if not
+ *  found or error if < 0. The scan stops at a descriptor that could not be
+ *  read, so the next lookup tries it again.
+ */
+static int LookupFid(Card_t *card, FidIndex_t *index, int kind, const char *label)
+{
+	static const uint8 type[2] = { 0xCC, 0xCD }, descType[2] = { 0xC4, 0xC9 };
+	const uint8 *list = index->List;
+	int i, labelLen = strlen(label);
+	for (i = 0; i < index->Count; i++) {
+		if (index->Entry[i].Fid >> 8 == type[kind] && strcmp(index->Entry[i].Label, label) == 0)
+			return index->Entry[i].Fid;
+	}
+	for (i = index->Next[kind]; i < index->ListLen; i += 2) {
+		if (list[i] == type[kind] && FindFid(descType[kind], list[i + 1], list, index->ListLen) >= 0) {
+			uint8 buf[256];
+			const uint8 *p;
+			FidEntry_t *entry = &index->Entry[index->Count];
+			int rc = SC_ReadFile(card, descType[kind] << 8 | list[i + 1], 0, buf, sizeof(buf));
+			int len = rc > 0 ? GetLabel(buf, rc, &p) : 0;
+			if (rc < 0) {
+				index->Next[kind] = i;
+				return rc;
+			}
+			if (len <= 0) /* no label */
+				continue;
+			entry->Label = (char*)ul_malloc(len + 1);
+			if (entry->Label == 0) {
+				index->Next[kind] = i;
+				return ERR_MEMORY;
+			}
+			memcpy(entry->Label, p, len);
+			entry->Label[len] = 0;
+			entry->Fid = type[kind] << 8 | list[i + 1];
+			index->Count++;
+			if (len == labelLen && memcmp(p, label, len) == 0) { /* case sensitive */
+				index->Next[kind] = i + 2;
+				return type[kind] << 8 | list[i + 1];
+			}
+		}
+	}
+	index->Next[kind] = i;
+	return 0;
+}
+static int GetFids(Card_t *card, FidIndex_t **ppIndex, const char *label, uint16 *pKeyFid, uint16 *pTemplateFid)
 {
+	FidIndex_t *index = *ppIndex;
 	uint8 list[2 * 128];
 	uint16 sw1sw2;
-	int rc, i;
+	int rc;
 	*pKeyFid = 0;
 	*pTemplateFid = 0;
 	/* - SmartCard-HSM: ENUMERATE OBJECTS */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(card,
 		0, 0x80,0x58,0x00,0x00,
 		0, 0,
 		list, sizeof(list),
@@ -186,32 +281,33 @@ static int GetFids(const char *label, uint16 *pKeyFid, uint16 *pTemplateFid)
 		return rc;
 	if (sw1sw2 != 0x9000 && sw1sw2 != 0x6282)
 		return ERR_APDU;
-	/* find key file id */
-	for (i = 0; i < rc; i += 2) {
-		if (list[i] == 0xCC && FindFid(0xC4, list[i + 1], list, rc) >= 0) {
-			uint8 buf[256];
-			int rc = SC_ReadFile(0xC400 | list[i + 1], 0, buf, sizeof(buf));
-			if (rc > 0 && FindLabel(label, buf, rc)) {
-				*pKeyFid = 0xCC00 | list[i + 1];
-				break;
-			}
-		}
+	/* objects created or deleted, the labels read so far may be stale */
+	if (index && !(index->ListLen == rc && memcmp(index->List, list, rc) == 0)) {
+		FreeIndex(index);
+		*ppIndex = index = 0;
+	}
+	if (index == 0) {
+		index = (FidIndex_t*)ul_calloc(1, sizeof(FidIndex_t));
+		if (index == 0)
+			return ERR_MEMORY;
+		memcpy(index->List, list, rc);
+		index->ListLen = rc;
+		*ppIndex = index;
 	}
+	/* find key file id */
+	rc = LookupFid(card, index, 0, label);
+	if (rc < 0)
+		return rc;
+	*pKeyFid = (uint16)rc;
 	if (*pKeyFid == 0) {
 		log_err("key '%s' not found", label);
 		return ERR_KEY;
 	}
 	/* find template file id */
-	for (i = 0; i < rc; i += 2) {
-		if (list[i] == 0xCD && FindFid(0xC9, list[i + 1], list, rc) >= 0) {
-			uint8 buf[256];
-			int rc = SC_ReadFile(0xC900 | list[i + 1], 0, buf, sizeof(buf));
-			if (rc > 0 && FindLabel(label, buf, rc)) {
-				*pTemplateFid = 0xCD00 | list[i + 1];
-				break;
-			}
-		}
-	}
+	rc = LookupFid(card, index, 1, label);
+	if (rc < 0)
+		return rc;
+	*pTemplateFid = (uint16)rc;
 	if (*pTemplateFid == 0) {
 		log_err("template '%s' not found", label);
 		return ERR_TEMPLATE;
@@ -227,7 +323,16 @@ static int GetFids(const char *label, uint16 *pKeyFid, uint16 *pTemplateFid)
  *******************************************************************************
  ******************************************************************************/
 
+/* hash context for the algorithm of a template */
 typedef struct {
+	int HashLen;
+	union {
+		sha256_context sha256;
+		sha512_context sha512;
+	} u;
+} HashCtx_t;
+
+typedef struct Template {
 	uint8 Version;
 	uint8 HeaderLength;
 	uint16 HashLen;
@@ -243,40 +348,120 @@ typedef struct {
 	uint16 KeyFid;
 	uint16 TemplateFid;
 	uint8 *pCms;
+	time_t Validated; /* time of the last cert id check */
+/* patch plan compiled at load time, see CompileTemplate */
+	HashCtx_t Prefix; /* hash of the signed attributes up to the first dynamic field */
+	struct {
+		uint16 Off, Len; /* relative to the signed attributes */
+	} Field[2];       /* signing time and MessageDigest in template order */
+	uint8 TimeFirst;  /* Field[0] is the signing time */
+	struct Template *Next; /* next less recently used template */
 	char Label[1]; /* space for the 0 terminator, need calloc(1, sizeof(Template_t) + strlen(label)) */
 } Template_t;
 
-static Template_t *This; /* current template (singleton) */
+#ifndef TEMPLATE_CACHE_SIZE
+#define TEMPLATE_CACHE_SIZE 4 /* default number of cached templates */
+#endif
+
+#ifndef UL_ARENA /* no threads in the zero-heap profile */
+
+#define ASYNC_QUEUE_MAX 64 /* queued hashes before ul_sign_async blocks */
+
+/* hash queued by ul_sign_async */
+typedef struct Job {
+	struct Job *Next;
+	ul_sign_cb_t Callback;
+	void *User;
+	int HashLen;
+	uint8 Hash[64];
+	char Label[1]; /* space for the 0 terminator, need malloc(sizeof(Job_t) + strlen(label)) */
+} Job_t;
+
+/* worker thread of a context, started by the first ul_sign_async */
+typedef struct {
+	THREAD_T Thread;
+	LOCK_T Lock;
+	COND_T Cond;           /* signaled when a job is queued or done */
+	Job_t *Head, *Tail;    /* queued jobs, oldest first */
+	int Queued;
+	int Submitted;         /* ticket of the last queued job */
+	int Completed;         /* ticket of the last finished job */
+	int Stop;              /* set by ul_close, the queue is drained first */
+} Worker_t;
+#endif /* UL_ARENA */
+
+#ifndef STREAM_BUFFER_SIZE
+#ifdef UL_ARENA
+#define STREAM_BUFFER_SIZE 1024
+#else
+#define STREAM_BUFFER_SIZE 16384 /* small updates are collected for the hash kernel */
+#endif
+#endif
+
+/* document hashed with ul_sign_update, see ul_sign_begin */
+typedef struct {
+	HashCtx_t Hash;
+	int Fill;              /* bytes in Buf */
+#ifndef UL_ARENA
+	THREAD_T Thread;       /* connects and validates the template meanwhile */
+	int Started;
+#endif
+	uint8 Buf[STREAM_BUFFER_SIZE];
+	char Label[1]; /* space for the 0 terminator, need ul_malloc(sizeof(Stream_t) + strlen(label)) */
+} Stream_t;
+
+/* signing context, one per token connection (see ul_open) */
+struct ul_ctx {
+	Card_t *Card;          /* 0 if not connected */
+	Template_t *Templates; /* cached templates, most recently used first */
+	int CacheSize;         /* 0 means TEMPLATE_CACHE_SIZE */
+	char *Reader;          /* 0 means first token found */
+	char *Pin;
+	int Revalidation;      /* UL_REVALIDATE_xxx */
+	int Interval;          /* seconds for UL_REVALIDATE_INTERVAL */
+	char *CacheDir;        /* directory of cached template files or 0 */
+	FidIndex_t *Index;     /* labels of the connected token */
+	time_t Now;            /* second of SigningTime */
+	char SigningTime[16];  /* UTCTime of Now, see GetSigningTime */
+	Stream_t *Stream;      /* 0 unless between ul_sign_begin and ul_sign_final */
+	Template_t *Prepared;  /* validated by the thread of ul_sign_begin */
+#ifndef UL_ARENA
+	Worker_t *Worker;      /* 0 if ul_sign_async was not used */
+#endif
+};
+
+static ul_ctx_t Default; /* context of sign_hash, sign_hash2 and release_template */
+
+#ifndef UL_ARENA
+/* token of a pool, see ul_pool_open */
+typedef struct {
+	ul_ctx_t *Ctx;
+	MUTEX Mutex;           /* one signature at a time per token */
+	volatile long Busy;    /* threads signing or waiting for the token */
+	time_t Down;           /* time of the last token error, 0 if none */
+} PoolMember_t;
+
+struct ul_pool {
+	char *Label;
+	int Count;
+	PoolMember_t Member[1]; /* Count members */
+};
+
+#define POOL_NAMES_SIZE   4096 /* reader names of SC_ListTokens */
+#define POOL_RETRY_DELAY  5    /* seconds a token is avoided after an error */
+
+/* errors of the token or reader, another token may succeed */
+#define TOKEN_ERROR(rc) ((rc) < 0 && (rc) != ERR_INVALID && (rc) != ERR_MEMORY && (rc) != ERR_HASH && (rc) != ERR_PIN)
+#endif /* UL_ARENA */
 
 #define TEMPLATE_VERSION (0)
 #define TEMPLATE_HEADER_LENGTH (20)
 
-static int LoadTemplate(const char *label)
+/* converts and checks the header as read from the token */
+static int ParseTemplateHeader(Template_t *This)
 {
-	uint8 *pCms;
-	int rc, end, off, labelLen;
-	if (label == 0)
-		return ERR_INVALID;
-	labelLen = strlen(label);
-	This = (Template_t*)calloc(1, sizeof(Template_t) + labelLen);
-	if (This == 0)
-		return ERR_MEMORY;
-	memcpy(This->Label, label, labelLen + 1); /* include 0 terminator */
-	rc = GetFids(label, &This->KeyFid, &This->TemplateFid);
-	if (rc < 0)
-		goto error;
-	/* read template header */
-	rc = SC_ReadFile(This->TemplateFid, 0, (uint8*)This, TEMPLATE_HEADER_LENGTH);
-	if (rc < 0)
-		goto error;
-	if (rc != TEMPLATE_HEADER_LENGTH) {
-		log_err("template '%s' invalid header length", label);
-		rc = ERR_TEMPLATE;
-		goto error;
-	}
 	if (This->Version != TEMPLATE_VERSION || This->HeaderLength != TEMPLATE_HEADER_LENGTH) {
-		rc = ERR_VERSION;
-		goto error;
+		return ERR_VERSION;
 	}
 #ifdef LITTLE_ENDIAN
 #define swap16(field) This->field = This->field >> 8 | This->field << 8;
@@ -294,64 +479,313 @@ static int LoadTemplate(const char *label)
 	/*
 		Sanity checks
 	*/
-	if (This->HashLen != 32) {
-		log_err("currently only SHA256 supported");
-		rc = ERR_SANITY;
-		goto error;
+	if (This->HashLen != 32 && This->HashLen != 48 && This->HashLen != 64) {
+		log_err("currently only SHA256, SHA384 and SHA512 supported");
+		return ERR_SANITY;
 	}
 	if (!(0 < This->SignedAttributesOff && This->SignedAttributesOff + This->SignedAttributesLen < This->SignatureOff)) {
 		log_err("signed attributes offset/length invalid");
-		rc = ERR_SANITY;
-		goto error;
+		return ERR_SANITY;
 	}
 	if (!(This->SignedAttributesOff < This->SigningTimeOff
 		&& This->SigningTimeOff + 13 <= This->SignedAttributesOff + This->SignedAttributesLen)) {
 		log_err("signing time offset invalid");
-		rc = ERR_SANITY;
-		goto error;
+		return ERR_SANITY;
 	}
 	if (!(This->SignedAttributesOff < This->MessageDigestOff
 		&& This->MessageDigestOff + This->HashLen <= This->SignedAttributesOff + This->SignedAttributesLen)) {
 		log_err("MessageDigest-Offset missing or invalid");
-		rc = ERR_SANITY;
-		goto error;
+		return ERR_SANITY;
+	}
+	if (!(This->SigningTimeOff + 13 <= This->MessageDigestOff
+		|| This->MessageDigestOff + This->HashLen <= This->SigningTimeOff)) {
+		log_err("signing time and MessageDigest overlap");
+		return ERR_SANITY;
 	}
 	if (!(0 < This->SignatureOff && This->SignatureOff + This->SignatureSize <= This->CMSLen)) {
 		log_err("Signature-Offset missing or invalid");
-		rc = ERR_SANITY;
+		return ERR_SANITY;
+	}
+	if (!(This->CertIdOff + 32 <= This->CMSLen)) {
+		log_err("cert id offset invalid");
+		return ERR_SANITY;
+	}
+	return 0;
+}
+
+static void CompileTemplate(Template_t *This);
+
+static int LoadTemplate(Card_t *card, FidIndex_t **ppIndex, const char *label, Template_t **ppThis)
+{
+	Template_t *This;
+	int rc, labelLen;
+	*ppThis = 0;
+	if (label == 0)
+		return ERR_INVALID;
+	labelLen = strlen(label);
+	This = (Template_t*)ul_calloc(1, sizeof(Template_t) + labelLen);
+	if (This == 0)
+		return ERR_MEMORY;
+	memcpy(This->Label, label, labelLen + 1); /* include 0 terminator */
+	rc = GetFids(card, ppIndex, label, &This->KeyFid, &This->TemplateFid);
+	if (rc < 0)
+		goto error;
+	/* read template header */
+	rc = SC_ReadFile(card, This->TemplateFid, 0, (uint8*)This, TEMPLATE_HEADER_LENGTH);
+	if (rc < 0)
+		goto error;
+	if (rc != TEMPLATE_HEADER_LENGTH) {
+		log_err("template '%s' invalid header length", label);
+		rc = ERR_TEMPLATE;
 		goto error;
 	}
-	This->pCms = (uint8*)calloc(1, This->CMSLen);
+	rc = ParseTemplateHeader(This);
+	if (rc < 0)
+		goto error;
+	This->pCms = (uint8*)ul_calloc(1, This->CMSLen);
 	if (This->pCms == 0) {
 		rc = ERR_MEMORY;
 		goto error;
 	}
-	/* read template body in MAX_OUT_IN bytes portions */
-	off = TEMPLATE_HEADER_LENGTH;
-	end = off + This->CMSLen;
-	pCms = This->pCms;
-	while (off < end) {
-		int len = end - off;
-		if (len > MAX_OUT_IN)
-			len = MAX_OUT_IN;
-		rc = SC_ReadFile(This->TemplateFid, off, pCms, len);
-		if (rc != len) {
-			log_err("template '%s' SC_ReadFile(.., %d, .., %d) returned %d", label, off, len, rc);
-			rc = ERR_TEMPLATE;
-			goto error;
-		}
-		off += len;
-		pCms += len;
+	/* read template body, SC_ReadFile uses the largest APDUs possible */
+	rc = SC_ReadFile(card, This->TemplateFid, TEMPLATE_HEADER_LENGTH, This->pCms, This->CMSLen);
+	if (rc != This->CMSLen) {
+		log_err("template '%s' SC_ReadFile(.., %d, .., %d) returned %d", label, TEMPLATE_HEADER_LENGTH, This->CMSLen, rc);
+		rc = ERR_TEMPLATE;
+		goto error;
 	}
+	This->Validated = time(0);
+	CompileTemplate(This);
+	*ppThis = This;
 	return 0;
 error:
 	if (This->pCms)
-		free(This->pCms);
-	free(This);
-	This = 0;
+		ul_free(This->pCms);
+	ul_free(This);
+	return rc;
+}
+
+/* frees a chain of templates */
+static void FreeTemplates(Template_t *This)
+{
+	while (This) {
+		Template_t *next = This->Next;
+		ul_free(This->pCms);
+		ul_free(This);
+		This = next;
+	}
+}
+
+/*
+	Returns the cached template with the given label and moves it to the front
+	of the list (most recently used), or 0 if the label is not cached.
+*/
+static Template_t *FindTemplate(ul_ctx_t *ctx, const char *label)
+{
+	Template_t **pp, *p;
+	for (pp = &ctx->Templates; (p = *pp) != 0; pp = &p->Next) {
+		if (strcmp(p->Label, label) == 0) {
+			*pp = p->Next;
+			p->Next = ctx->Templates;
+			ctx->Templates = p;
+			return p;
+		}
+	}
+	return 0;
+}
+
+/* frees the least recently used templates beyond the cache size */
+static void TrimTemplates(ul_ctx_t *ctx)
+{
+	Template_t *p, *q;
+	int n, size = ctx->CacheSize ? ctx->CacheSize : TEMPLATE_CACHE_SIZE;
+	for (p = ctx->Templates, n = 1; p != 0 && n < size; p = p->Next, n++)
+		;
+	if (p != 0) {
+		/* a template loaded later may get the address of the prepared one */
+		for (q = p->Next; q != 0; q = q->Next)
+			if (q == ctx->Prepared)
+				ctx->Prepared = 0;
+		FreeTemplates(p->Next);
+		p->Next = 0;
+	}
+}
+
+/*
+	Checks that the template still matches the token (robust against token changes).
+	The cert id is unique for each certificate, so a different token or a
+	re-personalized token is detected.
+*/
+static int ValidateTemplate(Card_t *card, Template_t *This)
+{
+	uint8 certId[32];
+	int rc = SC_ReadFile(card, This->TemplateFid, TEMPLATE_HEADER_LENGTH + This->CertIdOff, certId, sizeof(certId));
+	if (rc != sizeof(certId) || memcmp(certId, This->pCms + This->CertIdOff, sizeof(certId)))
+		return 0;
+	This->Validated = time(0);
+	return 1;
+}
+
+/*
+	Decides according to the revalidation policy of the context if the cert id
+	of a cached template must be read again before it is used.
+	UL_REVALIDATE_EVENT relies on the reader: PCSC counts card insertions
+	and removals per reader, CT-API reports the ICC power state (a removed
+	or reset card is never active again without REQUEST ICC).
+*/
+static int NeedsValidation(ul_ctx_t *ctx, Template_t *This)
+{
+	switch (ctx->Revalidation) {
+	case UL_REVALIDATE_INTERVAL:
+		return time(0) - This->Validated >= ctx->Interval;
+	case UL_REVALIDATE_EVENT:
+		return SC_CardChanged(ctx->Card) != 0; /* errors force a validation */
+	default:
+		return 1;
+	}
+}
+
+/*
+	On-disk template cache (ul_set_cache_dir). A file holds the FIDs and the
+	template of one label on one reader, named after a hash of reader and label:
+
+		"ULT1" | key length (2) | reader 0 label | KeyFid (2) | TemplateFid (2) | header (20) | CMS
+
+	Like a template cached in memory it is only used after the cert id check
+	with the token, so a changed token costs one READ BINARY and a reload.
+*/
+#define CACHE_MAGIC "ULT1"
+#define CACHE_PATH_MAX 512
+
+#define GET16(p) ((p)[0] << 8 | (p)[1])
+#define PUT16(p, v) ((p)[0] = (uint8)((v) >> 8), (p)[1] = (uint8)(v))
+
+#ifndef UL_ARENA /* the files are read into the system heap */
+static int CacheKey(Card_t *card, const char *label, uint8 key[256])
+{
+	const char *reader = SC_ReaderName(card);
+	int readerLen = strlen(reader) + 1, labelLen = strlen(label);
+	if (readerLen + labelLen > 256)
+		return ERR_INVALID;
+	memcpy(key, reader, readerLen);
+	memcpy(key + readerLen, label, labelLen);
+	return readerLen + labelLen;
+}
+
+static void CachePath(ul_ctx_t *ctx, const uint8 *key, int keyLen, char path[CACHE_PATH_MAX])
+{
+	sha256_context sha;
+	uint8 digest[32];
+	sha256_starts(&sha);
+	sha256_update(&sha, (uint8*)key, keyLen);
+	sha256_finish(&sha, digest);
+	/* ul_set_cache_dir limits the length of CacheDir */
+	sprintf(path, "%s/ul-%02x%02x%02x%02x%02x%02x%02x%02x.tpl", ctx->CacheDir,
+		digest[0], digest[1], digest[2], digest[3], digest[4], digest[5], digest[6], digest[7]);
+}
+
+static int LoadCachedTemplate(ul_ctx_t *ctx, const char *label, Template_t **ppThis)
+{
+	Template_t *This = 0;
+	uint8 key[256], *buf, *p;
+	char path[CACHE_PATH_MAX];
+	int rc, keyLen, len, labelLen;
+	*ppThis = 0;
+	keyLen = CacheKey(ctx->Card, label, key);
+	if (keyLen < 0)
+		return keyLen;
+	CachePath(ctx, key, keyLen, path);
+	ReadFromFile(path, buf, len);
+	if (buf == 0)
+		return ERR_TEMPLATE;
+	rc = ERR_TEMPLATE;
+	p = buf;
+	if (len < 6 + keyLen + 4 + TEMPLATE_HEADER_LENGTH
+		|| memcmp(p, CACHE_MAGIC, 4) || GET16(p + 4) != keyLen || memcmp(p + 6, key, keyLen))
+		goto error;
+	p += 6 + keyLen;
+	labelLen = strlen(label);
+	This = (Template_t*)ul_calloc(1, sizeof(Template_t) + labelLen);
+	if (This == 0) {
+		rc = ERR_MEMORY;
+		goto error;
+	}
+	memcpy(This->Label, label, labelLen + 1);
+	This->KeyFid = GET16(p);
+	This->TemplateFid = GET16(p + 2);
+	memcpy((uint8*)This, p + 4, TEMPLATE_HEADER_LENGTH);
+	p += 4 + TEMPLATE_HEADER_LENGTH;
+	rc = ParseTemplateHeader(This);
+	if (rc < 0)
+		goto error;
+	rc = ERR_TEMPLATE;
+	if (buf + len - p != This->CMSLen)
+		goto error;
+	This->pCms = (uint8*)ul_malloc(This->CMSLen);
+	if (This->pCms == 0) {
+		rc = ERR_MEMORY;
+		goto error;
+	}
+	memcpy(This->pCms, p, This->CMSLen);
+	if (!ValidateTemplate(ctx->Card, This))
+		goto error;
+	free(buf);
+	CompileTemplate(This);
+	*ppThis = This;
+	return 0;
+error:
+	free(buf);
+	FreeTemplates(This);
 	return rc;
 }
 
+static void StoreCachedTemplate(ul_ctx_t *ctx, Template_t *This)
+{
+	uint8 key[256], *buf, *p;
+	char path[CACHE_PATH_MAX], tmp[CACHE_PATH_MAX + 4];
+	int keyLen, len;
+	keyLen = CacheKey(ctx->Card, This->Label, key);
+	if (keyLen < 0)
+		return;
+	len = 6 + keyLen + 4 + TEMPLATE_HEADER_LENGTH + This->CMSLen;
+	buf = (uint8*)malloc(len);
+	if (buf == 0)
+		return;
+	p = buf;
+	memcpy(p, CACHE_MAGIC, 4);
+	PUT16(p + 4, keyLen);
+	memcpy(p + 6, key, keyLen);
+	p += 6 + keyLen;
+	PUT16(p, This->KeyFid);
+	PUT16(p + 2, This->TemplateFid);
+	p += 4;
+	/* header as stored on the token */
+	p[0] = This->Version;
+	p[1] = This->HeaderLength;
+	PUT16(p +  2, This->HashLen);
+	PUT16(p +  4, This->CertIdOff);
+	PUT16(p +  6, This->SignedAttributesOff);
+	PUT16(p +  8, This->SignedAttributesLen);
+	PUT16(p + 10, This->SigningTimeOff);
+	PUT16(p + 12, This->MessageDigestOff);
+	PUT16(p + 14, This->SignatureOff);
+	PUT16(p + 16, This->SignatureSize);
+	PUT16(p + 18, This->CMSLen);
+	p += TEMPLATE_HEADER_LENGTH;
+	memcpy(p, This->pCms, This->CMSLen);
+	/* write a temporary file and rename, readers never see a partial file */
+	CachePath(ctx, key, keyLen, path);
+	sprintf(tmp, "%s.tmp", path);
+	SaveToFile(tmp, buf, len);
+	if (rename(tmp, path) != 0) { /* Windows does not replace */
+		remove(path);
+		if (rename(tmp, path) != 0)
+			remove(tmp);
+	}
+	free(buf);
+}
+#endif /* UL_ARENA */
+
 /*******************************************************************************
  *******************************************************************************
  *******************************************************************************
@@ -360,39 +794,100 @@ error:
  *******************************************************************************
  ******************************************************************************/
 
-static int PatchSignedAttributes(
-	const uint8 *hash, int hashLen,
-	uint8 *hashToSign, int hashToSignLen)
+static void HashStarts(HashCtx_t *ctx, int hashLen)
+{
+	ctx->HashLen = hashLen;
+	if (hashLen == 32)
+		sha256_starts(&ctx->u.sha256);
+	else
+		sha512_starts(&ctx->u.sha512, hashLen == 48);
+}
+
+static void HashUpdate(HashCtx_t *ctx, const uint8 *data, int len)
+{
+	if (ctx->HashLen == 32)
+		sha256_update(&ctx->u.sha256, (uint8*)data, len);
+	else
+		sha512_update(&ctx->u.sha512, data, len);
+}
+
+static void HashFinish(HashCtx_t *ctx, uint8 *digest)
+{
+	if (ctx->HashLen == 32)
+		sha256_finish(&ctx->u.sha256, digest);
+	else
+		sha512_finish(&ctx->u.sha512, digest);
+}
+
+/* current UTC time as UTCTime YYMMDDhhmmssZ (13 chars) in ctx->SigningTime,
+   formatted once per second */
+static int GetSigningTime(ul_ctx_t *ctx)
 {
 	time_t now;
 	struct tm t;
-	char signingTime[16];
-	uint8 oldTag;
-	sha256_context ctx;
-	/* patch signing time */
 	time(&now);
-	t = *gmtime(&now);
+	if (now == ctx->Now)
+		return 0;
+#ifdef _WIN32 /* reentrant, contexts may sign in parallel threads */
+	gmtime_s(&t, &now);
+#else
+	gmtime_r(&now, &t);
+#endif
 	if (!(2013 - 1900 <= t.tm_year && t.tm_year < 2050 - 1900))
 		return ERR_TIME;
-	sprintf(signingTime,
+	sprintf(ctx->SigningTime,
 			"%02d%02d%02d%02d%02d%02dZ",
 			t.tm_year - 100, 1 + t.tm_mon, t.tm_mday,
 			t.tm_hour, t.tm_min, t.tm_sec);
-	memcpy(This->pCms + This->SigningTimeOff, signingTime, 13);
-	/* patch MessageDigest */
-	memcpy(This->pCms + This->MessageDigestOff, hash, hashLen);
-	/* calculate hash of signed attributes */
-	oldTag = This->pCms[This->SignedAttributesOff]; /* save old tag */
-	This->pCms[This->SignedAttributesOff] = 0x31; /* change from CONT [0] to SET tag */
-	/* todo additional support of at least SHA1 */
-	sha256_starts(&ctx);
-	sha256_update(&ctx, This->pCms + This->SignedAttributesOff, This->SignedAttributesLen);
-	sha256_finish(&ctx, hashToSign);
-	This->pCms[This->SignedAttributesOff] = oldTag; /* restore CONT [0] */
+	ctx->Now = now;
 	return 0;
 }
 
-static int PatchRSATemplate(const uint8 *hash, int hashLen)
+/*
+	Orders the dynamic fields of the signed attributes and hashes the
+	constant prefix once, the SET tag replacing the CONT [0] tag.
+*/
+static void CompileTemplate(Template_t *This)
+{
+	static const uint8 setTag = 0x31;
+	int timeOff = This->SigningTimeOff - This->SignedAttributesOff;
+	int digestOff = This->MessageDigestOff - This->SignedAttributesOff;
+	This->TimeFirst = timeOff < digestOff;
+	This->Field[!This->TimeFirst].Off = timeOff;
+	This->Field[!This->TimeFirst].Len = 13;
+	This->Field[This->TimeFirst].Off = digestOff;
+	This->Field[This->TimeFirst].Len = This->HashLen;
+	HashStarts(&This->Prefix, This->HashLen);
+	HashUpdate(&This->Prefix, &setTag, 1);
+	HashUpdate(&This->Prefix, This->pCms + This->SignedAttributesOff + 1, This->Field[0].Off - 1);
+}
+
+/*
+	Hashes the signed attributes of the template with the signing time and
+	the MessageDigest replaced, without patching the template. The hash
+	algorithm is the one of the MessageDigest, the constant prefix is
+	taken from the compiled template.
+*/
+static void HashSignedAttributes(Template_t *This,
+	const char *signingTime, const uint8 *hash,
+	uint8 *hashToSign)
+{
+	const uint8 *sa = This->pCms + This->SignedAttributesOff;
+	const uint8 *data[2];
+	HashCtx_t ctx = This->Prefix;
+	int pos;
+	data[!This->TimeFirst] = (const uint8*)signingTime;
+	data[This->TimeFirst] = hash;
+	HashUpdate(&ctx, data[0], This->Field[0].Len);
+	pos = This->Field[0].Off + This->Field[0].Len;
+	HashUpdate(&ctx, sa + pos, This->Field[1].Off - pos);
+	HashUpdate(&ctx, data[1], This->Field[1].Len);
+	pos = This->Field[1].Off + This->Field[1].Len;
+	HashUpdate(&ctx, sa + pos, This->SignedAttributesLen - pos);
+	HashFinish(&ctx, hashToSign);
+}
+
+static int PatchRSATemplate(Card_t *card, Template_t *This, uint8 *hashToSign, uint8 *sig)
 {
 	/*
 	const ASN1 headers to build the asn1 enclosed hash:
@@ -405,32 +900,21 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 	*/
 	static const uint8 encSHA256[] =
 		"\x30\x31\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x01\x05\x00\x04\x20";
-#if 0
-	static const uint8 encSHA1[] =
-		"\x30\x21\x30\x09\x06\x05\x2b\x0e\x03\x02\x1a\x05\x00\x04\x14";
 	static const uint8 encSHA384[] =
 		"\x30\x41\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x02\x05\x00\x04\x30";
 	static const uint8 encSHA512[] =
 		"\x30\x51\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x03\x05\x00\x04\x40";
+#if 0
+	static const uint8 encSHA1[] =
+		"\x30\x21\x30\x09\x06\x05\x2b\x0e\x03\x02\x1a\x05\x00\x04\x14";
 #endif
-	int ix, encLen;
+	int ix, encLen, hashLen = This->HashLen;
 	const uint8 *enc;
-	uint8 *sig;
-	int rc;
-	uint8 hashToSign[32];
-	rc = PatchSignedAttributes(hash, hashLen, hashToSign, sizeof(hashToSign));
-	if (rc < 0)
-		return rc;
 	switch (hashLen) {
 	case 32:          /* SHA-256 */
 		enc = encSHA256;
 		encLen = sizeof(encSHA256) - 1;
 		break;
-#if 0
-	case 20:          /* SHA1 */
-		enc = encSHA1;
-		encLen = sizeof(encSHA1) - 1;
-		break;
 	case 48:          /* SHA-384 */
 		enc = encSHA384;
 		encLen = sizeof(encSHA384) - 1;
@@ -439,6 +923,11 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 		enc = encSHA512;
 		encLen = sizeof(encSHA512) - 1;
 		break;
+#if 0
+	case 20:          /* SHA1 */
+		enc = encSHA1;
+		encLen = sizeof(encSHA1) - 1;
+		break;
 #endif
 	default:
 		return ERR_HASH;
@@ -446,9 +935,8 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 	/*
 		Build 0x00, 0x01, 0xff, ... , 0xff, 0x00, asn1-enclosed-hash.
 		The total size must match exactly the RSA modulus size (RSA2k: 2048 bits == 256 bytes).
-		Use space of p->Signature !!!
+		Use space of the signature !!!
 	*/
-	sig = This->pCms + This->SignatureOff;
 	ix = This->SignatureSize;
 	memcpy(sig + (ix -= hashLen), hashToSign, hashLen);
 	memcpy(sig + (ix -= encLen), enc, encLen);
@@ -456,18 +944,13 @@ static int PatchRSATemplate(const uint8 *hash, int hashLen)
 	memset(sig + 2, -1, ix - 2);
 	sig[1] = 1;
 	sig[0] = 0;
-	return SC_Sign(0x20, (uint8)This->KeyFid, sig, This->SignatureSize, sig, This->SignatureSize);
+	return SC_Sign(card, 0x20, (uint8)This->KeyFid, sig, This->SignatureSize, sig, This->SignatureSize);
 }
 
-static int PatchECDSATemplate(const uint8 *hash, int hashLen)
+static int PatchECDSATemplate(Card_t *card, Template_t *This, uint8 *hashToSign, uint8 *sig)
 {
 	int rc;
-	uint8 hashToSign[32];
-	uint8 *sig;
-	rc = PatchSignedAttributes(hash, hashLen, hashToSign, sizeof(hashToSign));
-	if (rc < 0)
-		return rc;
-	rc = SC_Sign(0x70, (uint8)This->KeyFid, hashToSign, hashLen, This->pCms + This->SignatureOff, This->SignatureSize);
+	rc = SC_Sign(card, 0x70, (uint8)This->KeyFid, hashToSign, This->HashLen, sig, This->SignatureSize);
 	if (rc < 0)
 		return rc;
 	/*
@@ -494,7 +977,6 @@ static int PatchECDSATemplate(const uint8 *hash, int hashLen)
 		0x25=37: 0x02 0x21 // s INTEGER of length 0x21 (== 33)
 		0x48=72:
 	*/
-	sig = This->pCms + This->SignatureOff;
 	if ((57 <= rc && rc <= 72) && sig[0] == 0x30) {
 		int ri = 2 + 2;          /*  index of r data */
 		int rl = sig[ri - 1];    /* length of r data */
@@ -527,77 +1009,1007 @@ static int PatchECDSATemplate(const uint8 *hash, int hashLen)
  *******************************************************************************
  *******************************************************************************
  ******************************************************************************/
-/*
- *  Signature of specified hash
- *
- *  pin         : smartcard pin
- *  label       : key and template label
- *  hash        : Hash to be signed
- *  hashLen     : Length of hash (20, 32, 48 or 64)
- *  ppCms       : returns the CMS data in *ppCms
- *
- *  Returns : CMS size or error if <= 0
- */
-int EXPORT_FUNC sign_hash(
-	const char *pin, const char *label,
-	const uint8 *hash, int hashLen,
-	const uint8 **ppCms)
+/* drops all templates and the token connection of the context */
+static void Release(ul_ctx_t *ctx)
 {
-	return sign_hash2(0, pin, label, hash, hashLen, ppCms);
+	FreeTemplates(ctx->Templates);
+	ctx->Templates = 0;
+	ctx->Prepared = 0;
+	FreeIndex(ctx->Index);
+	ctx->Index = 0;
+	SC_Close(ctx->Card);
+	ctx->Card = 0;
 }
 
-int EXPORT_FUNC sign_hash2(
+/* loads from the cache directory if possible, else from the token */
+static int LoadTemplateCached(ul_ctx_t *ctx, const char *label, Template_t **ppThis)
+{
+	int rc;
+#ifndef UL_ARENA
+	if (ctx->CacheDir && LoadCachedTemplate(ctx, label, ppThis) == 0)
+		return 0;
+#endif
+	rc = LoadTemplate(ctx->Card, &ctx->Index, label, ppThis);
+#ifndef UL_ARENA
+	if (rc == 0 && ctx->CacheDir)
+		StoreCachedTemplate(ctx, *ppThis);
+#endif
+	return rc;
+}
+
+/*
+	Returns the validated template for label in *ppThis, (re)connecting
+	with reader and pin if required. On success the token is held in a
+	transaction until Unlock, so the signature costs a single transmit
+	and no other process can reset or log out the token in between.
+*/
+static int GetTemplate(ul_ctx_t *ctx,
 	const char *reader, const char *pin, const char *label,
-	const uint8 *hash, int hashLen,
-	const uint8 **ppCms)
+	Template_t **ppThis)
 {
+	Template_t *This;
 	int rc;
-	*ppCms = 0;
-	if (This) { /* try to reuse template */
-		if (strcmp(This->Label, label)) { /* This->Label != label */
-			release_template();
-		} else {
-			uint8 certId[32];
-			rc = SC_ReadFile(This->TemplateFid, TEMPLATE_HEADER_LENGTH + This->CertIdOff, certId, sizeof(certId));
-			if (rc != sizeof(certId) || memcmp(certId, This->pCms + This->CertIdOff, sizeof(certId)))
-				release_template(); /* do not reuse, release rescources */
-		}
+	*ppThis = 0;
+	if (label == 0)
+		return ERR_INVALID;
+	if (ctx->Card && SC_Begin(ctx->Card) < 0)
+		Release(ctx); /* token gone, start over */
+	This = FindTemplate(ctx, label);
+	/* a template validated during ul_sign_update is checked again only after a card event */
+	if (This && (This == ctx->Prepared ? SC_CardChanged(ctx->Card) != 0 : NeedsValidation(ctx, This))
+		&& !ValidateTemplate(ctx->Card, This)) {
+		Release(ctx); /* token changed, do not reuse any template */
+		This = 0;
 	}
-	if (This == 0) { // start over
-		rc = SC_Open(pin, reader);
-		if (rc < 0) {
-			log_err("SC_Open returned %d", rc);
-			return rc;
+	if (This == 0) {
+		if (ctx->Card) { /* try to load with the already open token */
+			rc = LoadTemplateCached(ctx, label, &This);
+			if (rc < 0)
+				Release(ctx); /* start over, the token may have changed */
 		}
-		rc = LoadTemplate(label);
-		if (rc < 0) {
-			log_err("LoadTemplate('%s') returned %d", label, rc);
-			SC_Close();
-			return rc;
+		if (This == 0) { /* start over */
+			rc = SC_Open(&ctx->Card, pin, reader);
+			if (rc < 0) {
+				log_err("SC_Open returned %d", rc);
+				return rc;
+			}
+			rc = SC_Begin(ctx->Card);
+			if (rc < 0) {
+				Release(ctx);
+				return rc;
+			}
+			rc = LoadTemplateCached(ctx, label, &This);
+			if (rc < 0) {
+				log_err("LoadTemplate('%s') returned %d", label, rc);
+				Release(ctx);
+				return rc;
+			}
 		}
+		This->Next = ctx->Templates;
+		ctx->Templates = This;
+		TrimTemplates(ctx);
+	}
+	*ppThis = This;
+	return 0;
+}
+
+/* ends the transaction of GetTemplate unless the token was released */
+static void Unlock(ul_ctx_t *ctx)
+{
+	if (ctx->Card)
+		SC_End(ctx->Card);
+}
+
+/*
+	Signs the template, the dynamic fields go to signingTime (13 bytes),
+	messageDigest (HashLen bytes) and sig (SignatureSize bytes). These
+	point into a copy of the template or to separate buffers (ul_sign_iov).
+*/
+static int SignFields(ul_ctx_t *ctx, Template_t *This,
+	const uint8 *hash, int hashLen,
+	uint8 *signingTime, uint8 *messageDigest, uint8 *sig)
+{
+	uint8 hashToSign[64];
+	int rc = 0;
+	if (hashLen != This->HashLen) {
+		log_err("Template '%s' requires a hash of %d bytes", This->Label, This->HashLen);
+		return ERR_HASH;
 	}
+	rc = GetSigningTime(ctx);
+	if (rc < 0)
+		return rc;
+	HashSignedAttributes(This, ctx->SigningTime, hash, hashToSign);
+	memcpy(signingTime, ctx->SigningTime, 13);
+	memcpy(messageDigest, hash, hashLen);
 	if (This->SignatureSize == 256) /* RSA */
-		rc = PatchRSATemplate(hash, hashLen);
+		rc = PatchRSATemplate(ctx->Card, This, hashToSign, sig);
 	else if (This->SignatureSize == 72)
-		rc = PatchECDSATemplate(hash, hashLen);
-	if (rc == 72 || rc == 256) {
-		*ppCms = This->pCms;
+		rc = PatchECDSATemplate(ctx->Card, This, hashToSign, sig);
+	if (rc == 72 || rc == 256)
 		return This->CMSLen; // OK
-	}
 	/* error case */
-	log_err("Template '%s' invalid signature size %d", label, rc);
-	release_template();
+	log_err("Template '%s' invalid signature size %d", This->Label, rc);
+	Release(ctx);
 	if (rc >= 0) 
 		rc = ERR_KEY_SIZE;
 	return rc;
 }
 
-void EXPORT_FUNC release_template()
+/*
+	Patches and signs the template in pCms, either This->pCms or a copy.
+*/
+static int SignTemplate(ul_ctx_t *ctx, Template_t *This, uint8 *pCms, const uint8 *hash, int hashLen)
 {
-	if (This == 0)
+	return SignFields(ctx, This, hash, hashLen,
+		pCms + This->SigningTimeOff, pCms + This->MessageDigestOff, pCms + This->SignatureOff);
+}
+
+/*
+	Signs with the context, (re)connecting with reader and pin if required.
+*/
+static int Sign(ul_ctx_t *ctx,
+	const char *reader, const char *pin, const char *label,
+	const uint8 *hash, int hashLen,
+	const uint8 **ppCms)
+{
+	Template_t *This;
+	int rc;
+	*ppCms = 0;
+	rc = GetTemplate(ctx, reader, pin, label, &This);
+	if (rc < 0)
+		return rc;
+	rc = SignTemplate(ctx, This, This->pCms, hash, hashLen);
+	Unlock(ctx);
+	if (rc > 0)
+		*ppCms = This->pCms;
+	return rc;
+}
+
+/*
+	Signs n hashes with one template validation. out_lens[i] is the size
+	of out_cms[i] on input and the CMS size or error on output.
+*/
+static int SignBatch(ul_ctx_t *ctx,
+	const char *reader, const char *pin, const char *label,
+	const uint8 **hashes, int hashLen, int n,
+	uint8 **out_cms, int *out_lens)
+{
+	Template_t *This;
+	int rc, i, locked;
+	if (n < 0)
+		return ERR_INVALID;
+	rc = GetTemplate(ctx, reader, pin, label, &This);
+	locked = rc >= 0;
+	for (i = 0; i < n && rc >= 0; i++) {
+		if (out_lens[i] < This->CMSLen) {
+			out_lens[i] = ERR_MEMORY;
+			continue;
+		}
+		memcpy(out_cms[i], This->pCms, This->CMSLen);
+		rc = SignTemplate(ctx, This, out_cms[i], hashes[i], hashLen);
+		out_lens[i] = rc;
+	}
+	for (; i < n; i++) /* not signed after a fatal error */
+		out_lens[i] = rc;
+	if (locked)
+		Unlock(ctx);
+	return rc < 0 ? rc : n;
+}
+
+static char *StrDup(const char *str)
+{
+	char *dup;
+	if (str == 0)
+		return 0;
+	dup = (char*)ul_malloc(strlen(str) + 1);
+	if (dup)
+		strcpy(dup, str);
+	return dup;
+}
+
+/*******************************************************************************
+ *******************************************************************************
+ *******************************************************************************
+ *******************************************************************************
+ **************************** public Functions *********************************
+ *******************************************************************************
+ *******************************************************************************
+ *******************************************************************************
+ ******************************************************************************/
+/*
+ *  Open a signing context on a token
+ *
+ *  reader      : PCSC reader name or 0 for the first SmartCard-HSM found
+ *  pin         : smartcard pin
+ *  pCtx        : returns the context in *pCtx, release with ul_close
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC ul_open(const char *reader, const char *pin, ul_ctx_t **pCtx)
+{
+	ul_ctx_t *ctx;
+	int rc;
+	*pCtx = 0;
+	ctx = (ul_ctx_t*)ul_calloc(1, sizeof(ul_ctx_t));
+	if (ctx == 0)
+		return ERR_MEMORY;
+	ctx->Reader = StrDup(reader);
+	ctx->Pin = StrDup(pin);
+	if (reader && !ctx->Reader || pin && !ctx->Pin) {
+		ul_close(ctx);
+		return ERR_MEMORY;
+	}
+	rc = SC_Open(&ctx->Card, pin, reader);
+	if (rc < 0) {
+		log_err("SC_Open returned %d", rc);
+		ul_close(ctx);
+		return rc;
+	}
+	*pCtx = ctx;
+	return 0;
+}
+
+/*
+ *  Signature of specified hash with the token of the context
+ *
+ *  ctx         : context returned by ul_open
+ *  label       : key and template label
+ *  hash        : Hash to be signed
+ *  hashLen     : Length of hash (32, 48 or 64 as required by the template)
+ *  ppCms       : returns the CMS data in *ppCms, valid until the next call with ctx
+ *
+ *  Returns : CMS size or error if <= 0
+ */
+int EXPORT_FUNC ul_sign(ul_ctx_t *ctx, const char *label,
+	const uint8 *hash, int hashLen,
+	const uint8 **ppCms)
+{
+	return Sign(ctx, ctx->Reader, ctx->Pin, label, hash, hashLen, ppCms);
+}
+
+/*
+ *  Signature of several hashes with the same key, the template is validated
+ *  once for the whole batch
+ *
+ *  ctx         : context returned by ul_open
+ *  label       : key and template label
+ *  hashes      : n hashes to be signed
+ *  hashLen     : Length of each hash (32, 48 or 64 as required by the template)
+ *  n           : number of hashes
+ *  out_cms     : n buffers receiving the CMS data
+ *  out_lens    : in: size of out_cms[i], out: CMS size or error if <= 0
+ *
+ *  Returns : n or error if < 0 (out_lens[i] > 0 marks the CMS already written)
+ */
+int EXPORT_FUNC ul_sign_hashes(ul_ctx_t *ctx, const char *label,
+	const uint8 **hashes, int hashLen, int n,
+	uint8 **out_cms, int *out_lens)
+{
+	return SignBatch(ctx, ctx->Reader, ctx->Pin, label, hashes, hashLen, n, out_cms, out_lens);
+}
+
+/*
+ *  Signature of a hash into a caller buffer, the template is copied to cms
+ *  and patched there, so the CMS stays valid independent of other calls
+ *
+ *  ctx         : context returned by ul_open
+ *  label       : key and template label
+ *  hash        : Hash to be signed
+ *  hashLen     : Length of hash (32, 48 or 64 as required by the template)
+ *  cms         : buffer receiving the CMS data
+ *  cmsSize     : size of cms
+ *
+ *  Returns : CMS size or error if <= 0 (ERR_MEMORY if cms is too small)
+ */
+int EXPORT_FUNC ul_sign_into(ul_ctx_t *ctx, const char *label,
+	const uint8 *hash, int hashLen,
+	uint8 *cms, int cmsSize)
+{
+	Template_t *This;
+	int rc;
+	rc = GetTemplate(ctx, ctx->Reader, ctx->Pin, label, &This);
+	if (rc < 0)
+		return rc;
+	if (cmsSize < This->CMSLen) {
+		Unlock(ctx);
+		return ERR_MEMORY;
+	}
+	memcpy(cms, This->pCms, This->CMSLen);
+	rc = SignTemplate(ctx, This, cms, hash, hashLen);
+	Unlock(ctx);
+	return rc;
+}
+
+/*
+ *  Signature of a hash as iovec for writev, without copying the template.
+ *  The signing time, MessageDigest and signature are written to fields,
+ *  the other entries point into the cached template. These stay valid
+ *  while the template is cached, i.e. until ul_close, a call failing or
+ *  a template load evicting it (see ul_set_cache_size).
+ *
+ *  ctx         : context returned by ul_open
+ *  label       : key and template label
+ *  hash        : Hash to be signed
+ *  hashLen     : Length of hash (32, 48 or 64 as required by the template)
+ *  fields      : buffer receiving the dynamic fields
+ *  fieldsSize  : size of fields, UL_FIELDS_SIZE is always sufficient
+ *  iov         : receives the CMS in up to UL_IOV_MAX entries
+ *
+ *  Returns : number of iov entries or error if <= 0
+ */
+int EXPORT_FUNC ul_sign_iov(ul_ctx_t *ctx, const char *label,
+	const uint8 *hash, int hashLen,
+	uint8 *fields, int fieldsSize,
+	ul_iovec_t iov[UL_IOV_MAX])
+{
+	Template_t *This;
+	struct { int off, len; uint8 *data; } field[3], tmp;
+	int rc, i, j, pos, n;
+	rc = GetTemplate(ctx, ctx->Reader, ctx->Pin, label, &This);
+	if (rc < 0)
+		return rc;
+	if (fieldsSize < 13 + This->HashLen + This->SignatureSize) {
+		Unlock(ctx);
+		return ERR_MEMORY;
+	}
+	field[0].off = This->SigningTimeOff;
+	field[0].len = 13;
+	field[0].data = fields;
+	field[1].off = This->MessageDigestOff;
+	field[1].len = This->HashLen;
+	field[1].data = field[0].data + field[0].len;
+	field[2].off = This->SignatureOff;
+	field[2].len = This->SignatureSize;
+	field[2].data = field[1].data + field[1].len;
+	rc = SignFields(ctx, This, hash, hashLen, field[0].data, field[1].data, field[2].data);
+	Unlock(ctx);
+	if (rc < 0)
+		return rc;
+	/* sort by offset, alternate static and dynamic parts */
+	for (i = 1; i < 3; i++)
+		for (j = i; j > 0 && field[j].off < field[j - 1].off; j--) {
+			tmp = field[j];
+			field[j] = field[j - 1];
+			field[j - 1] = tmp;
+		}
+	for (i = pos = n = 0; i < 3; i++) {
+		if (field[i].off > pos) {
+			iov[n].iov_base = This->pCms + pos;
+			iov[n++].iov_len = field[i].off - pos;
+		}
+		iov[n].iov_base = field[i].data;
+		iov[n++].iov_len = field[i].len;
+		pos = field[i].off + field[i].len;
+	}
+	if (pos < This->CMSLen) {
+		iov[n].iov_base = This->pCms + pos;
+		iov[n++].iov_len = This->CMSLen - pos;
+	}
+	return n;
+}
+
+/*
+ *  Set the maximum number of templates (labels) cached by the context
+ *
+ *  ctx         : context returned by ul_open
+ *  size        : number of templates, at least 1
+ *
+ *  Returns : previous size or error if < 0
+ */
+int EXPORT_FUNC ul_set_cache_size(ul_ctx_t *ctx, int size)
+{
+	int old = ctx->CacheSize ? ctx->CacheSize : TEMPLATE_CACHE_SIZE;
+	if (size < 1)
+		return ERR_INVALID;
+	ctx->CacheSize = size;
+	TrimTemplates(ctx);
+	return old;
+}
+
+/*
+ *  Set when cached templates are checked against the token
+ *
+ *  ctx         : context returned by ul_open
+ *  policy      : UL_REVALIDATE_ALWAYS   (default) read the cert id before each signature
+ *                UL_REVALIDATE_INTERVAL read the cert id if the last check is older than seconds
+ *                UL_REVALIDATE_EVENT    read the cert id only after a card or reader event
+ *  seconds     : interval for UL_REVALIDATE_INTERVAL
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC ul_set_revalidation(ul_ctx_t *ctx, int policy, int seconds)
+{
+	if (!(UL_REVALIDATE_ALWAYS <= policy && policy <= UL_REVALIDATE_EVENT) || seconds < 0)
+		return ERR_INVALID;
+	ctx->Revalidation = policy;
+	ctx->Interval = seconds;
+	return 0;
+}
+
+/*
+ *  Keep the templates in files in the directory dir, so that a new process
+ *  signs without loading the template from the token. A cached template is
+ *  used after the cert id check (one READ BINARY). The directory must not
+ *  be writable by others, the static CMS parts are taken from the files.
+ *
+ *  ctx         : context returned by ul_open
+ *  dir         : existing directory or 0 to disable the cache
+ *
+ *  Returns : 0 or error if < 0 (ERR_INVALID in the UL_ARENA profile,
+ *            the files are read into the system heap)
+ */
+int EXPORT_FUNC ul_set_cache_dir(ul_ctx_t *ctx, const char *dir)
+{
+	char *dup = 0;
+	if (dir) {
+#ifdef UL_ARENA
+		return ERR_INVALID;
+#endif
+		/* room for "/ul-<16 hex digits>.tpl" in CACHE_PATH_MAX */
+		if (strlen(dir) > CACHE_PATH_MAX - 32)
+			return ERR_INVALID;
+		dup = StrDup(dir);
+		if (dup == 0)
+			return ERR_MEMORY;
+	}
+	ul_free(ctx->CacheDir);
+	ctx->CacheDir = dup;
+	return 0;
+}
+
+#ifndef UL_ARENA
+/* signs the queued hashes in order until ul_close */
+static THREAD_FUNC(WorkerMain, arg)
+{
+	ul_ctx_t *ctx = (ul_ctx_t*)arg;
+	Worker_t *w = ctx->Worker;
+	const uint8 *pCms;
+	Job_t *job;
+	int rc;
+	lock_enter(&w->Lock);
+	for (;;) {
+		while (w->Head == 0 && !w->Stop)
+			cond_wait(&w->Cond, &w->Lock);
+		job = w->Head;
+		if (job == 0)
+			break;
+		w->Head = job->Next;
+		if (w->Head == 0)
+			w->Tail = 0;
+		w->Queued--;
+		lock_leave(&w->Lock);
+		rc = Sign(ctx, ctx->Reader, ctx->Pin, job->Label, job->Hash, job->HashLen, &pCms);
+		job->Callback(job->User, rc, rc > 0 ? pCms : 0);
+		ul_free(job);
+		lock_enter(&w->Lock);
+		w->Completed++;
+		cond_broadcast(&w->Cond);
+	}
+	lock_leave(&w->Lock);
+	return THREAD_RETURN;
+}
+
+static int StartWorker(ul_ctx_t *ctx)
+{
+	Worker_t *w = (Worker_t*)ul_calloc(1, sizeof(Worker_t));
+	if (w == 0)
+		return ERR_MEMORY;
+	if (lock_init(&w->Lock)) {
+		ul_free(w);
+		return ERR_MUTEX;
+	}
+	if (cond_init(&w->Cond)) {
+		lock_destroy(&w->Lock);
+		ul_free(w);
+		return ERR_MUTEX;
+	}
+	ctx->Worker = w;
+	if (thread_start(&w->Thread, WorkerMain, ctx)) {
+		log_err("worker thread not started");
+		ctx->Worker = 0;
+		cond_destroy(&w->Cond);
+		lock_destroy(&w->Lock);
+		ul_free(w);
+		return ERR_HOST;
+	}
+	return 0;
+}
+
+/* waits for the queued jobs and stops the worker thread */
+static void StopWorker(ul_ctx_t *ctx)
+{
+	Worker_t *w = ctx->Worker;
+	lock_enter(&w->Lock);
+	w->Stop = 1;
+	cond_broadcast(&w->Cond);
+	lock_leave(&w->Lock);
+	thread_join(w->Thread);
+	cond_destroy(&w->Cond);
+	lock_destroy(&w->Lock);
+	ul_free(w);
+	ctx->Worker = 0;
+}
+
+/*
+ *  Queue a hash for signature by the worker thread of the context and
+ *  return at once. The worker signs the queued hashes in order and passes
+ *  each CMS to cb, called in the worker thread. Once a hash is queued,
+ *  the context must only be used with ul_sign_async, ul_sign_poll and
+ *  ul_sign_wait until ul_sign_wait returned for all tickets. The call
+ *  blocks while ASYNC_QUEUE_MAX hashes are queued, so cb must not call
+ *  ul_sign_async or ul_sign_wait.
+ *
+ *  ctx         : context returned by ul_open
+ *  label       : key and template label
+ *  hash        : Hash to be signed, copied
+ *  hashLen     : Length of hash (32, 48 or 64 as required by the template)
+ *  cb          : receives user, the CMS size or error and the CMS data
+ *  user        : passed to cb
+ *
+ *  Returns : ticket > 0 for ul_sign_wait or error if < 0
+ */
+int EXPORT_FUNC ul_sign_async(ul_ctx_t *ctx, const char *label,
+	const uint8 *hash, int hashLen,
+	ul_sign_cb_t cb, void *user)
+{
+	Worker_t *w;
+	Job_t *job;
+	int rc;
+	if (label == 0 || cb == 0 || hashLen <= 0 || hashLen > (int)sizeof(job->Hash))
+		return ERR_INVALID;
+	if (ctx->Worker == 0) {
+		rc = StartWorker(ctx);
+		if (rc < 0)
+			return rc;
+	}
+	job = (Job_t*)ul_malloc(sizeof(Job_t) + strlen(label));
+	if (job == 0)
+		return ERR_MEMORY;
+	job->Next = 0;
+	job->Callback = cb;
+	job->User = user;
+	job->HashLen = hashLen;
+	memcpy(job->Hash, hash, hashLen);
+	strcpy(job->Label, label);
+	w = ctx->Worker;
+	lock_enter(&w->Lock);
+	while (w->Queued >= ASYNC_QUEUE_MAX)
+		cond_wait(&w->Cond, &w->Lock);
+	if (w->Tail)
+		w->Tail->Next = job;
+	else
+		w->Head = job;
+	w->Tail = job;
+	w->Queued++;
+	rc = ++w->Submitted;
+	cond_broadcast(&w->Cond);
+	lock_leave(&w->Lock);
+	return rc;
+}
+
+/*
+ *  Number of hashes queued by ul_sign_async and not yet passed to the
+ *  callback, does not block
+ *
+ *  ctx         : context returned by ul_open
+ *
+ *  Returns : number of pending signatures
+ */
+int EXPORT_FUNC ul_sign_poll(ul_ctx_t *ctx)
+{
+	Worker_t *w = ctx->Worker;
+	int n;
+	if (w == 0)
+		return 0;
+	lock_enter(&w->Lock);
+	n = w->Submitted - w->Completed;
+	lock_leave(&w->Lock);
+	return n;
+}
+
+/*
+ *  Wait until the callback of a ticket returned, the hashes are signed in
+ *  the order of ul_sign_async, so all earlier tickets are done as well
+ *
+ *  ctx         : context returned by ul_open
+ *  ticket      : returned by ul_sign_async, 0 waits for all queued hashes
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC ul_sign_wait(ul_ctx_t *ctx, int ticket)
+{
+	Worker_t *w = ctx->Worker;
+	if (w == 0)
+		return ticket == 0 ? 0 : ERR_INVALID;
+	lock_enter(&w->Lock);
+	if (ticket == 0)
+		ticket = w->Submitted;
+	if (ticket < 0 || ticket > w->Submitted) {
+		lock_leave(&w->Lock);
+		return ERR_INVALID;
+	}
+	while (w->Completed < ticket)
+		cond_wait(&w->Cond, &w->Lock);
+	lock_leave(&w->Lock);
+	return 0;
+}
+#endif /* UL_ARENA */
+
+#ifndef UL_ARENA
+/* connects the token and validates the template while the caller hashes */
+static THREAD_FUNC(PrepareMain, arg)
+{
+	ul_ctx_t *ctx = (ul_ctx_t*)arg;
+	Template_t *This;
+	if (GetTemplate(ctx, ctx->Reader, ctx->Pin, ctx->Stream->Label, &This) == 0) {
+		SC_CardChanged(ctx->Card); /* later events force another validation */
+		Unlock(ctx);
+		ctx->Prepared = This;
+	}
+	return THREAD_RETURN;
+}
+#endif
+
+/*
+ *  Start the signature of a document hashed by the library, pass the
+ *  document with ul_sign_update and get the CMS with ul_sign_final. A
+ *  thread connects the token and validates the template meanwhile, the
+ *  context must not be used otherwise until ul_sign_final.
+ *
+ *  ctx         : context returned by ul_open
+ *  label       : key and template label
+ *  hashLen     : 32, 48 or 64 for SHA-256, SHA-384 or SHA-512 as required by the template
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC ul_sign_begin(ul_ctx_t *ctx, const char *label, int hashLen)
+{
+	Stream_t *s;
+	if (label == 0 || ctx->Stream || hashLen != 32 && hashLen != 48 && hashLen != 64)
+		return ERR_INVALID;
+	s = (Stream_t*)ul_malloc(sizeof(Stream_t) + strlen(label));
+	if (s == 0)
+		return ERR_MEMORY;
+	strcpy(s->Label, label);
+	s->Fill = 0;
+	HashStarts(&s->Hash, hashLen);
+	ctx->Stream = s;
+#ifndef UL_ARENA
+	/* without the thread ul_sign_final connects */
+	s->Started = thread_start(&s->Thread, PrepareMain, ctx) == 0;
+#endif
+	return 0;
+}
+
+/*
+ *  Hash the next part of the document, parts of any size are buffered for
+ *  the hash kernel
+ *
+ *  ctx         : context passed to ul_sign_begin
+ *  data        : next part of the document
+ *  len         : length of data
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC ul_sign_update(ul_ctx_t *ctx, const uint8 *data, int len)
+{
+	Stream_t *s = ctx->Stream;
+	int n;
+	if (s == 0 || len < 0)
+		return ERR_INVALID;
+	if (s->Fill) {
+		n = STREAM_BUFFER_SIZE - s->Fill;
+		if (n > len)
+			n = len;
+		memcpy(s->Buf + s->Fill, data, n);
+		s->Fill += n;
+		data += n;
+		len -= n;
+		if (s->Fill < STREAM_BUFFER_SIZE)
+			return 0;
+		HashUpdate(&s->Hash, s->Buf, STREAM_BUFFER_SIZE);
+		s->Fill = 0;
+	}
+	if (len >= STREAM_BUFFER_SIZE) {
+		HashUpdate(&s->Hash, data, len);
+	} else {
+		memcpy(s->Buf, data, len);
+		s->Fill = len;
+	}
+	return 0;
+}
+
+/* waits for the thread of ul_sign_begin */
+static void JoinStream(Stream_t *s)
+{
+#ifndef UL_ARENA
+	if (s->Started)
+		thread_join(s->Thread);
+	s->Started = 0;
+#endif
+}
+
+/*
+ *  Signature of the document passed with ul_sign_update
+ *
+ *  ctx         : context passed to ul_sign_begin
+ *  ppCms       : returns the CMS data in *ppCms, valid until the next call with ctx
+ *
+ *  Returns : CMS size or error if <= 0
+ */
+int EXPORT_FUNC ul_sign_final(ul_ctx_t *ctx, const uint8 **ppCms)
+{
+	Stream_t *s = ctx->Stream;
+	uint8 hash[64];
+	int rc;
+	*ppCms = 0;
+	if (s == 0)
+		return ERR_INVALID;
+	if (s->Fill)
+		HashUpdate(&s->Hash, s->Buf, s->Fill);
+	HashFinish(&s->Hash, hash);
+	JoinStream(s);
+	rc = Sign(ctx, ctx->Reader, ctx->Pin, s->Label, hash, s->Hash.HashLen, ppCms);
+	ctx->Prepared = 0;
+	ctx->Stream = 0;
+	ul_free(s);
+	return rc;
+}
+
+/*
+ *  Release the templates and the token connection of the context, the
+ *  hashes queued by ul_sign_async are signed first
+ */
+void EXPORT_FUNC ul_close(ul_ctx_t *ctx)
+{
+	if (ctx == 0)
 		return;
-	SC_Close();
-	free(This->pCms);
-	free(This);
-	This = 0;
+#ifndef UL_ARENA
+	if (ctx->Worker)
+		StopWorker(ctx);
+#endif
+	if (ctx->Stream) {
+		JoinStream(ctx->Stream);
+		ul_free(ctx->Stream);
+	}
+	Release(ctx);
+	ul_free(ctx->CacheDir);
+	if (ctx->Pin) {
+		memset(ctx->Pin, 0, strlen(ctx->Pin));
+		ul_free(ctx->Pin);
+	}
+	ul_free(ctx->Reader);
+	ul_free(ctx);
+}
+
+#ifndef UL_ARENA
+/*
+ *  Open a pool of all tokens holding label, for applications signing from
+ *  several threads with ul_pool_sign
+ *
+ *  pin         : smartcard pin, the same for all tokens
+ *  label       : key and template label
+ *  pPool       : returns the pool in *pPool, release with ul_pool_close
+ *
+ *  Returns : number of tokens in the pool or error if < 0
+ */
+int EXPORT_FUNC ul_pool_open(const char *pin, const char *label, ul_pool_t **pPool)
+{
+	char names[POOL_NAMES_SIZE], *name;
+	ul_pool_t *pool;
+	ul_ctx_t *ctx;
+	Template_t *This;
+	int rc, n;
+	*pPool = 0;
+	if (label == 0)
+		return ERR_INVALID;
+	n = SC_ListTokens(names, sizeof(names));
+	if (n <= 0) {
+		log_err("no token found");
+		return n < 0 ? n : ERR_CARD;
+	}
+	pool = (ul_pool_t*)ul_calloc(1, sizeof(ul_pool_t) + (n - 1) * sizeof(PoolMember_t));
+	if (pool == 0)
+		return ERR_MEMORY;
+	pool->Label = StrDup(label);
+	if (pool->Label == 0) {
+		ul_free(pool);
+		return ERR_MEMORY;
+	}
+	rc = ERR_KEY;
+	for (name = names; *name; name += strlen(name) + 1) {
+		rc = ul_open(name, pin, &ctx);
+		if (rc < 0) {
+			if (rc == ERR_PIN) /* do not try the pin on the other tokens */
+				break;
+			continue;
+		}
+		rc = GetTemplate(ctx, ctx->Reader, ctx->Pin, label, &This);
+		if (rc < 0) {
+			ul_close(ctx);
+			continue;
+		}
+		Unlock(ctx);
+		if (mutex_init(&pool->Member[pool->Count].Mutex)) {
+			ul_close(ctx);
+			rc = ERR_MUTEX;
+			break;
+		}
+		pool->Member[pool->Count++].Ctx = ctx;
+	}
+	if (rc == ERR_PIN || rc == ERR_MUTEX || pool->Count == 0) {
+		log_err("no token with '%s' opened (%d)", label, rc);
+		ul_pool_close(pool);
+		return rc < 0 ? rc : ERR_KEY;
+	}
+	*pPool = pool;
+	return pool->Count;
+}
+
+/* the member with the fewest threads, members with a recent error last */
+static PoolMember_t *LeastBusy(ul_pool_t *pool)
+{
+	PoolMember_t *best = 0, *m;
+	time_t now = time(0);
+	int i, bestDown = 0;
+	for (i = 0; i < pool->Count; i++) {
+		int down;
+		m = &pool->Member[i];
+		down = m->Down != 0 && now - m->Down < POOL_RETRY_DELAY;
+		if (best == 0 || down < bestDown || down == bestDown && m->Busy < best->Busy) {
+			best = m;
+			bestDown = down;
+		}
+	}
+	return best;
+}
+
+/*
+ *  Signature of a hash into a caller buffer with the least busy token of
+ *  the pool. If the token fails, e.g. because it was pulled, the hash is
+ *  signed with another token. Thread safe, each token signs one hash at
+ *  a time.
+ *
+ *  pool        : pool returned by ul_pool_open
+ *  hash        : Hash to be signed
+ *  hashLen     : Length of hash (32, 48 or 64 as required by the template)
+ *  cms         : buffer receiving the CMS data
+ *  cmsSize     : size of cms
+ *
+ *  Returns : CMS size or error if <= 0
+ */
+int EXPORT_FUNC ul_pool_sign(ul_pool_t *pool,
+	const uint8 *hash, int hashLen,
+	uint8 *cms, int cmsSize)
+{
+	PoolMember_t *m;
+	int rc = ERR_CARD, tries;
+	for (tries = 0; tries < pool->Count; tries++) {
+		m = LeastBusy(pool);
+		InterlockedIncrement(&m->Busy);
+		if (mutex_lock(&m->Mutex)) {
+			InterlockedDecrement(&m->Busy);
+			return ERR_MUTEX;
+		}
+		rc = ul_sign_into(m->Ctx, pool->Label, hash, hashLen, cms, cmsSize);
+		m->Down = TOKEN_ERROR(rc) ? time(0) : 0;
+		mutex_unlock(&m->Mutex);
+		InterlockedDecrement(&m->Busy);
+		if (!TOKEN_ERROR(rc))
+			break;
+		log_err("token '%s' returned %d, retry with another token", m->Ctx->Reader, rc);
+	}
+	return rc;
+}
+
+/*
+ *  Close the tokens of the pool, no ul_pool_sign may be running
+ *
+ *  pool        : pool returned by ul_pool_open
+ */
+void EXPORT_FUNC ul_pool_close(ul_pool_t *pool)
+{
+	int i;
+	if (pool == 0)
+		return;
+	for (i = 0; i < pool->Count; i++) {
+		mutex_destroy(&pool->Member[i].Mutex);
+		ul_close(pool->Member[i].Ctx);
+	}
+	ul_free(pool->Label);
+	ul_free(pool);
+}
+#endif /* UL_ARENA */
+
+/*
+ *  Signature of specified hash
+ *
+ *  pin         : smartcard pin
+ *  label       : key and template label
+ *  hash        : Hash to be signed
+ *  hashLen     : Length of hash (32, 48 or 64 as required by the template)
+ *  ppCms       : returns the CMS data in *ppCms
+ *
+ *  Returns : CMS size or error if <= 0
+ */
+int EXPORT_FUNC sign_hash(
+	const char *pin, const char *label,
+	const uint8 *hash, int hashLen,
+	const uint8 **ppCms)
+{
+	return sign_hash2(0, pin, label, hash, hashLen, ppCms);
+}
+
+int EXPORT_FUNC sign_hash2(
+	const char *reader, const char *pin, const char *label,
+	const uint8 *hash, int hashLen,
+	const uint8 **ppCms)
+{
+	return Sign(&Default, reader, pin, label, hash, hashLen, ppCms);
+}
+
+/*
+ *  Signature of several hashes with the default context, see ul_sign_hashes
+ */
+int EXPORT_FUNC sign_hashes(
+	const char *pin, const char *label,
+	const uint8 **hashes, int hashLen, int n,
+	uint8 **out_cms, int *out_lens)
+{
+	return SignBatch(&Default, 0, pin, label, hashes, hashLen, n, out_cms, out_lens);
+}
+
+/*
+ *  Set the maximum number of templates (labels) cached by sign_hash
+ *
+ *  size        : number of templates, at least 1
+ *
+ *  Returns : previous size or error if < 0
+ */
+int EXPORT_FUNC set_template_cache_size(int size)
+{
+	return ul_set_cache_size(&Default, size);
+}
+
+/*
+ *  Set the revalidation policy of sign_hash, see ul_set_revalidation
+ */
+int EXPORT_FUNC set_template_revalidation(int policy, int seconds)
+{
+	return ul_set_revalidation(&Default, policy, seconds);
+}
+
+/*
+ *  Copy the APDU statistics of all contexts: calls, bytes, errors and a
+ *  latency histogram per instruction, plus connections and card resets.
+ *  The counters are always on, they cost a few atomic adds per APDU.
+ *
+ *  stats       : receives the counters since the start or ul_reset_stats
+ */
+void EXPORT_FUNC ul_get_stats(ul_stats_t *stats)
+{
+	SC_GetStats(stats);
+}
+
+/*
+ *  Reset the APDU statistics
+ */
+void EXPORT_FUNC ul_reset_stats()
+{
+	SC_ResetStats();
+}
+
+/*
+ *  Set the template cache directory of sign_hash, see ul_set_cache_dir
+ */
+int EXPORT_FUNC set_template_cache_dir(const char *dir)
+{
+	return ul_set_cache_dir(&Default, dir);
+}
+
+void EXPORT_FUNC release_template()
+{
+	Release(&Default);
+	ul_set_cache_dir(&Default, 0); /* release_template frees all memory, the directory must be set again */
+	SC_Cleanup(); /* CT-API ports kept open for the next SC_Open */
 }
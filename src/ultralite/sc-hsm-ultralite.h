@@ -18,6 +18,8 @@
 #ifndef _sc_hsm_ultralite_h_
 #define _sc_hsm_ultralite_h_
 
+#include <stddef.h>
+
 /* Remove on a big endian system */
 #ifndef LITTLE_ENDIAN
 #define LITTLE_ENDIAN
@@ -58,6 +60,117 @@
 #endif
 #endif
 
+typedef struct ul_ctx ul_ctx_t;
+
+/* revalidation policies of cached templates */
+#define UL_REVALIDATE_ALWAYS   0
+#define UL_REVALIDATE_INTERVAL 1
+#define UL_REVALIDATE_EVENT    2
+
+int EXPORT_FUNC ul_open(const char *reader, const char *pin, ul_ctx_t **pCtx);
+
+int EXPORT_FUNC ul_sign(ul_ctx_t *ctx, const char *label,
+	const unsigned char *hash, int hashLen,
+	const unsigned char **ppCMS);
+
+int EXPORT_FUNC ul_sign_hashes(ul_ctx_t *ctx, const char *label,
+	const unsigned char **hashes, int hashLen, int n,
+	unsigned char **out_cms, int *out_lens);
+
+/* same layout as struct iovec of writev */
+typedef struct {
+	void *iov_base;
+	size_t iov_len;
+} ul_iovec_t;
+
+#define UL_IOV_MAX 7                   /* iov entries of ul_sign_iov */
+#define UL_FIELDS_SIZE (13 + 64 + 256) /* signing time, hash and signature */
+
+int EXPORT_FUNC ul_sign_into(ul_ctx_t *ctx, const char *label,
+	const unsigned char *hash, int hashLen,
+	unsigned char *cms, int cmsSize);
+
+int EXPORT_FUNC ul_sign_iov(ul_ctx_t *ctx, const char *label,
+	const unsigned char *hash, int hashLen,
+	unsigned char *fields, int fieldsSize,
+	ul_iovec_t iov[UL_IOV_MAX]);
+
+int EXPORT_FUNC ul_set_cache_size(ul_ctx_t *ctx, int size);
+
+int EXPORT_FUNC ul_set_revalidation(ul_ctx_t *ctx, int policy, int seconds);
+
+int EXPORT_FUNC ul_set_cache_dir(ul_ctx_t *ctx, const char *dir);
+
+void EXPORT_FUNC ul_close(ul_ctx_t *ctx);
+
+int EXPORT_FUNC ul_sign_begin(ul_ctx_t *ctx, const char *label, int hashLen);
+
+int EXPORT_FUNC ul_sign_update(ul_ctx_t *ctx, const unsigned char *data, int len);
+
+int EXPORT_FUNC ul_sign_final(ul_ctx_t *ctx, const unsigned char **ppCms);
+
+#ifndef UL_ARENA /* the arena profile has no threads */
+/* completion of ul_sign_async, rc is the CMS size or an error if <= 0,
+   cms is valid until the callback returns */
+typedef void (*ul_sign_cb_t)(void *user, int rc, const unsigned char *cms);
+
+int EXPORT_FUNC ul_sign_async(ul_ctx_t *ctx, const char *label,
+	const unsigned char *hash, int hashLen,
+	ul_sign_cb_t cb, void *user);
+
+int EXPORT_FUNC ul_sign_poll(ul_ctx_t *ctx);
+
+int EXPORT_FUNC ul_sign_wait(ul_ctx_t *ctx, int ticket);
+
+typedef struct ul_pool ul_pool_t;
+
+int EXPORT_FUNC ul_pool_open(const char *pin, const char *label, ul_pool_t **pPool);
+
+int EXPORT_FUNC ul_pool_sign(ul_pool_t *pool,
+	const unsigned char *hash, int hashLen,
+	unsigned char *cms, int cmsSize);
+
+void EXPORT_FUNC ul_pool_close(ul_pool_t *pool);
+#endif /* UL_ARENA */
+
+/* APDU statistics of the process, ins[] of ul_stats_t */
+#define UL_STATS_SELECT    0 /* SELECT (A4)                 */
+#define UL_STATS_VERIFY    1 /* VERIFY (20)                 */
+#define UL_STATS_READ      2 /* READ BINARY (B1)            */
+#define UL_STATS_SIGN      3 /* SIGN (68)                   */
+#define UL_STATS_ENUMERATE 4 /* ENUMERATE OBJECTS (58)      */
+#define UL_STATS_OTHER     5 /* any other instruction       */
+#define UL_STATS_INS       6
+
+/* hist[i] counts latencies of 2^i to 2^(i+1) - 1 us, hist[0] below 2 us,
+   the last bucket all above */
+#define UL_STATS_BUCKETS   24
+
+typedef struct {
+	unsigned long long calls;
+	unsigned long long errors;    /* transmission errors, status words other than 9000 and 6282 */
+	unsigned long long bytes_out; /* command data */
+	unsigned long long bytes_in;  /* response data */
+	unsigned long long time_us;   /* sum of the latencies */
+	unsigned long long hist[UL_STATS_BUCKETS];
+} ul_ins_stats_t;
+
+typedef struct {
+	ul_ins_stats_t ins[UL_STATS_INS];
+	unsigned long long opens;     /* token connections established */
+	unsigned long long resets;    /* reconnects after a card reset (PCSC), REQUEST ICC (CT-API) */
+} ul_stats_t;
+
+void EXPORT_FUNC ul_get_stats(ul_stats_t *stats);
+void EXPORT_FUNC ul_reset_stats();
+
+#ifdef UL_ARENA
+/* zero-heap profile, all memory of the library is taken from the arena */
+int EXPORT_FUNC ul_set_arena(void *mem, int size);
+
+void EXPORT_FUNC ul_arena_usage(int *used, int *peak);
+#endif
+
 int EXPORT_FUNC sign_hash(const char *pin, const char *label,
 	const unsigned char *hash, int hashLen,
 	const unsigned char **ppCMS);
@@ -66,6 +179,18 @@ int EXPORT_FUNC sign_hash2(const char *reader, const char *pin, const char *labe
 	const unsigned char *hash, int hashLen,
 	const unsigned char **ppCMS);
 
+int EXPORT_FUNC set_template_cache_size(int size);
+
+int EXPORT_FUNC sign_hashes(const char *pin, const char *label,
+	const unsigned char **hashes, int hashLen, int n,
+	unsigned char **out_cms, int *out_lens);
+
+int EXPORT_FUNC set_template_revalidation(int policy, int seconds);
+
+int EXPORT_FUNC set_template_cache_dir(const char *dir);
+
+/* Frees the templates and clears the cache directory, set it again before the next sign_hash if needed.
+   The cache size and revalidation policy are kept. */
 void EXPORT_FUNC release_template();
 
 typedef struct {
@@ -78,4 +203,23 @@ void EXPORT_FUNC sha256_starts(sha256_context *ctx);
 void EXPORT_FUNC sha256_update(sha256_context *ctx, unsigned char *input, unsigned int length);
 void EXPORT_FUNC sha256_finish(sha256_context *ctx, unsigned char digest[32]);
 
+/* Hash independent messages in parallel SIMD lanes, pass up to
+   SHA256_MB_LANES contexts per call for the best throughput */
+#define SHA256_MB_LANES 8
+
+void EXPORT_FUNC sha256_update_mb(sha256_context *ctx[], unsigned char *input[], unsigned int length[], int n);
+void EXPORT_FUNC sha256_finish_mb(sha256_context *ctx[], unsigned char *digest[], int n);
+
+typedef struct {
+	unsigned long long total[2];
+	unsigned long long state[8];
+	unsigned char buffer[128];
+	int is384;
+} sha512_context;
+
+/* SHA-384 if is384 is set, else SHA-512 */
+void EXPORT_FUNC sha512_starts(sha512_context *ctx, int is384);
+void EXPORT_FUNC sha512_update(sha512_context *ctx, const unsigned char *input, unsigned int length);
+void EXPORT_FUNC sha512_finish(sha512_context *ctx, unsigned char digest[64]);
+
 #endif /* _sc_hsm_ultralite_h_ */
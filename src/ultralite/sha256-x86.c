@@ -0,0 +1,366 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file sha256-x86.c
+ * @brief SHA-256 compression functions for x86 SHA extensions and AVX2
+ */
+
+#include "sha256-x86.h"
+
+#ifdef SHA256_X86
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(isa)
+#else
+#include <cpuid.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+typedef unsigned char uint8;
+typedef unsigned int uint32;
+
+static const uint32 K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+/*******************************************************************************
+ ************************** CPU feature detection ******************************
+ ******************************************************************************/
+
+static void cpuid(int leaf, int sub, uint32 r[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int*)r, leaf, sub);
+#else
+	__cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+static uint32 xgetbv0()
+{
+#ifdef _MSC_VER
+	return (uint32)_xgetbv(0);
+#else
+	uint32 eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
+#endif
+}
+
+/*
+ *  Returns the SHA256_CPU_xxx features usable by this process
+ */
+int sha256_cpu_features()
+{
+	uint32 r1[4], r7[4];
+	int features = 0, leaves;
+	cpuid(0, 0, r1);
+	leaves = r1[0];
+	if (leaves < 1)
+		return 0;
+	cpuid(1, 0, r1);
+	/* SSE2: leaf 1 EDX bit 26 */
+	if (r1[3] & 1 << 26)
+		features |= SHA256_CPU_SSE2;
+	if (leaves < 7)
+		return features;
+	cpuid(7, 0, r7);
+	/* SHA: leaf 7 EBX bit 29, SSSE3: leaf 1 ECX bit 9, SSE4.1: leaf 1 ECX bit 19 */
+	if ((r7[1] & 1 << 29) && (r1[2] & 1 << 9) && (r1[2] & 1 << 19))
+		features |= SHA256_CPU_SHANI;
+	/* AVX2: leaf 7 EBX bit 5, BMI2: leaf 7 EBX bit 8, YMM state saved by the OS (OSXSAVE) */
+	if ((r7[1] & 1 << 5) && (r7[1] & 1 << 8) && (r1[2] & 1 << 27) && (xgetbv0() & 6) == 6)
+		features |= SHA256_CPU_AVX2;
+	return features;
+}
+
+/*******************************************************************************
+ ***************************** SHA extensions **********************************
+ ******************************************************************************/
+
+/*
+	The SHA extensions keep the state as ABEF and CDGH and perform two rounds
+	per sha256rnds2, the message schedule uses sha256msg1/sha256msg2 on
+	groups of four words.
+*/
+TARGET("sha,sse4.1")
+void sha256_blocks_shani(uint32 state[8], const uint8 *data, uint32 blocks)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+	int g;
+
+	tmp    = _mm_loadu_si128((const __m128i*)&state[0]); /* DCBA */
+	state1 = _mm_loadu_si128((const __m128i*)&state[4]); /* HGFE */
+	tmp    = _mm_shuffle_epi32(tmp, 0xB1);                /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);             /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);             /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);          /* CDGH */
+
+	for (; blocks > 0; blocks--, data += 64) {
+		abef = state0;
+		cdgh = state1;
+		for (g = 0; g < 16; g++) { /* 16 groups of 4 rounds */
+			if (g < 4) {
+				w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * g)), MASK);
+			} else {
+				tmp = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+				w[g & 3] = _mm_sha256msg2_epu32(tmp, w[(g + 3) & 3]);
+			}
+			msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i*)&K[4 * g]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp    = _mm_shuffle_epi32(state0, 0x1B);    /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);    /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);    /* HGFE */
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+/*******************************************************************************
+ ********************************** AVX2 ***************************************
+ ******************************************************************************/
+
+/*
+	The rounds of a single message are one long dependency chain, vectors do
+	not help there. AVX2 is used for the message schedule instead: the low
+	and the high 128-bit lane carry two consecutive blocks, so W + K of two
+	blocks is computed at once and the rounds run on scalar registers with
+	the BMI2 rotate (rorx).
+*/
+
+#define ROTR(x,n) ((x) >> (n) | (x) << (32 - (n)))
+
+#define S2(x) (ROTR(x, 2) ^ ROTR(x,13) ^ ROTR(x,22))
+#define S3(x) (ROTR(x, 6) ^ ROTR(x,11) ^ ROTR(x,25))
+
+#define F0(x,y,z) ((x & y) | (z & (x | y)))
+#define F1(x,y,z) (z ^ (x & (y ^ z)))
+
+#define P(a,b,c,d,e,f,g,h,wk)                   \
+{                                               \
+	temp1 = h + S3(e) + F1(e,f,g) + wk;         \
+	temp2 = S2(a) + F0(a,b,c);                  \
+	d += temp1; h = temp1 + temp2;              \
+}
+
+#define VROTR(x,n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define VS0(x) _mm256_xor_si256(_mm256_xor_si256(VROTR(x, 7), VROTR(x,18)), _mm256_srli_epi32(x, 3))
+#define VS1(x) _mm256_xor_si256(_mm256_xor_si256(VROTR(x,17), VROTR(x,19)), _mm256_srli_epi32(x,10))
+
+/* W + K for the block in the low lane to wk[0], the one in the high lane to wk[1] */
+TARGET("avx2")
+static void schedule2(const uint8 *lo, const uint8 *hi, uint32 wk[2][64])
+{
+	const __m256i MASK = _mm256_set_epi64x(
+		0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+		0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	const __m256i LO2 = _mm256_set_epi32(0, 0, -1, -1, 0, 0, -1, -1);
+	__m256i x[4], t, k;
+	int g;
+	for (g = 0; g < 16; g++) {
+		if (g < 4) {
+			t = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(lo + 16 * g))),
+				_mm_loadu_si128((const __m128i*)(hi + 16 * g)), 1);
+			x[g] = _mm256_shuffle_epi8(t, MASK);
+		} else {
+			/* W[t-16] + s0(W[t-15]) + W[t-7] */
+			__m256i *x0 = &x[g & 3], x1 = x[(g + 1) & 3], x2 = x[(g + 2) & 3], x3 = x[(g + 3) & 3];
+			t = _mm256_add_epi32(*x0, VS0(_mm256_alignr_epi8(x1, *x0, 4)));
+			t = _mm256_add_epi32(t, _mm256_alignr_epi8(x3, x2, 4));
+			/* + s1(W[t-2]) for words 0 and 1, their W[t-2] is in x3 */
+			t = _mm256_add_epi32(t, _mm256_and_si256(VS1(_mm256_shuffle_epi32(x3, 0xFE)), LO2));
+			/* + s1(W[t-2]) for words 2 and 3, their W[t-2] are words 0 and 1 */
+			t = _mm256_add_epi32(t, _mm256_andnot_si256(LO2, VS1(_mm256_shuffle_epi32(t, 0x40))));
+			*x0 = t;
+		}
+		k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&K[4 * g]));
+		t = _mm256_add_epi32(x[g & 3], k);
+		_mm_storeu_si128((__m128i*)&wk[0][4 * g], _mm256_castsi256_si128(t));
+		_mm_storeu_si128((__m128i*)&wk[1][4 * g], _mm256_extracti128_si256(t, 1));
+	}
+}
+
+TARGET("bmi2")
+static void rounds(uint32 state[8], const uint32 wk[64])
+{
+	uint32 temp1, temp2, A, B, C, D, E, F, G, H;
+	int t;
+	A = state[0];
+	B = state[1];
+	C = state[2];
+	D = state[3];
+	E = state[4];
+	F = state[5];
+	G = state[6];
+	H = state[7];
+	for (t = 0; t < 64; t += 8) {
+		P( A, B, C, D, E, F, G, H, wk[t + 0] );
+		P( H, A, B, C, D, E, F, G, wk[t + 1] );
+		P( G, H, A, B, C, D, E, F, wk[t + 2] );
+		P( F, G, H, A, B, C, D, E, wk[t + 3] );
+		P( E, F, G, H, A, B, C, D, wk[t + 4] );
+		P( D, E, F, G, H, A, B, C, wk[t + 5] );
+		P( C, D, E, F, G, H, A, B, wk[t + 6] );
+		P( B, C, D, E, F, G, H, A, wk[t + 7] );
+	}
+	state[0] += A;
+	state[1] += B;
+	state[2] += C;
+	state[3] += D;
+	state[4] += E;
+	state[5] += F;
+	state[6] += G;
+	state[7] += H;
+}
+
+TARGET("avx2,bmi2")
+void sha256_blocks_avx2(uint32 state[8], const uint8 *data, uint32 blocks)
+{
+	uint32 wk[2][64];
+	for (; blocks >= 2; blocks -= 2, data += 128) {
+		schedule2(data, data + 64, wk);
+		rounds(state, wk[0]);
+		rounds(state, wk[1]);
+	}
+	if (blocks) { /* odd block, schedule it twice */
+		schedule2(data, data, wk);
+		rounds(state, wk[0]);
+	}
+}
+
+/*******************************************************************************
+ ****************************** Multi-buffer ***********************************
+ ******************************************************************************/
+
+/*
+	Independent messages have no dependency on each other, so each 32-bit
+	lane of a vector register runs the rounds of its own message: 4 lanes
+	with SSE2, 8 lanes with AVX2. The state is kept transposed, i.e. vector
+	A holds the A words of all lanes.
+*/
+
+#define GET_BE32(p) ((uint32)(p)[0] << 24 | (uint32)(p)[1] << 16 | (uint32)(p)[2] << 8 | (uint32)(p)[3])
+
+#define MB_ROUNDS(V, ADD, XOR, AND, OR, SRL, SLL, SET1, LOADW)                   \
+	for (t = 0; t < 64; t++) {                                                \
+		if (t < 16) {                                                         \
+			w[t] = LOADW(t);                                                  \
+		} else {                                                              \
+			V w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];                   \
+			V s0 = XOR(XOR(OR(SRL(w15, 7), SLL(w15, 25)),                     \
+				OR(SRL(w15, 18), SLL(w15, 14))), SRL(w15, 3));                \
+			V s1 = XOR(XOR(OR(SRL(w2, 17), SLL(w2, 15)),                      \
+				OR(SRL(w2, 19), SLL(w2, 13))), SRL(w2, 10));                  \
+			w[t & 15] = ADD(ADD(w[t & 15], s0), ADD(w[(t - 7) & 15], s1));    \
+		}                                                                     \
+		temp1 = ADD(ADD(h, SET1(K[t])), w[t & 15]);                           \
+		temp1 = ADD(temp1, XOR(XOR(OR(SRL(e, 6), SLL(e, 26)),                 \
+			OR(SRL(e, 11), SLL(e, 21))), OR(SRL(e, 25), SLL(e, 7))));         \
+		temp1 = ADD(temp1, XOR(g, AND(e, XOR(f, g))));                        \
+		temp2 = XOR(XOR(OR(SRL(a, 2), SLL(a, 30)),                            \
+			OR(SRL(a, 13), SLL(a, 19))), OR(SRL(a, 22), SLL(a, 10)));         \
+		temp2 = ADD(temp2, OR(AND(a, b), AND(c, OR(a, b))));                  \
+		h = g; g = f; f = e; e = ADD(d, temp1);                               \
+		d = c; c = b; b = a; a = ADD(temp1, temp2);                           \
+	}
+
+#define L4(t, i) (int)GET_BE32(p[i] + 4 * (t))
+#define LOADW4(t) _mm_setr_epi32(L4(t, 0), L4(t, 1), L4(t, 2), L4(t, 3))
+
+TARGET("sse2")
+void sha256_blocks_x4_sse2(uint32 *state[4], const uint8 *data[4], uint32 blocks)
+{
+	__m128i v[8], w[16], a, b, c, d, e, f, g, h, temp1, temp2;
+	const uint8 *p[4];
+	int i, t;
+
+	for (i = 0; i < 4; i++)
+		p[i] = data[i];
+	for (i = 0; i < 8; i++)
+		v[i] = _mm_setr_epi32(state[0][i], state[1][i], state[2][i], state[3][i]);
+
+	for (; blocks > 0; blocks--) {
+		a = v[0]; b = v[1]; c = v[2]; d = v[3];
+		e = v[4]; f = v[5]; g = v[6]; h = v[7];
+		MB_ROUNDS(__m128i, _mm_add_epi32, _mm_xor_si128, _mm_and_si128, _mm_or_si128,
+			_mm_srli_epi32, _mm_slli_epi32, _mm_set1_epi32, LOADW4)
+		v[0] = _mm_add_epi32(v[0], a); v[1] = _mm_add_epi32(v[1], b);
+		v[2] = _mm_add_epi32(v[2], c); v[3] = _mm_add_epi32(v[3], d);
+		v[4] = _mm_add_epi32(v[4], e); v[5] = _mm_add_epi32(v[5], f);
+		v[6] = _mm_add_epi32(v[6], g); v[7] = _mm_add_epi32(v[7], h);
+		for (i = 0; i < 4; i++)
+			p[i] += 64;
+	}
+
+	for (i = 0; i < 8; i++) {
+		uint32 x[4];
+		_mm_storeu_si128((__m128i*)x, v[i]);
+		state[0][i] = x[0]; state[1][i] = x[1]; state[2][i] = x[2]; state[3][i] = x[3];
+	}
+}
+
+#define LOADW8(t) _mm256_setr_epi32(L4(t, 0), L4(t, 1), L4(t, 2), L4(t, 3), \
+	L4(t, 4), L4(t, 5), L4(t, 6), L4(t, 7))
+
+TARGET("avx2")
+void sha256_blocks_x8_avx2(uint32 *state[8], const uint8 *data[8], uint32 blocks)
+{
+	__m256i v[8], w[16], a, b, c, d, e, f, g, h, temp1, temp2;
+	const uint8 *p[8];
+	int i, t;
+
+	for (i = 0; i < 8; i++)
+		p[i] = data[i];
+	for (i = 0; i < 8; i++)
+		v[i] = _mm256_setr_epi32(state[0][i], state[1][i], state[2][i], state[3][i],
+			state[4][i], state[5][i], state[6][i], state[7][i]);
+
+	for (; blocks > 0; blocks--) {
+		a = v[0]; b = v[1]; c = v[2]; d = v[3];
+		e = v[4]; f = v[5]; g = v[6]; h = v[7];
+		MB_ROUNDS(__m256i, _mm256_add_epi32, _mm256_xor_si256, _mm256_and_si256, _mm256_or_si256,
+			_mm256_srli_epi32, _mm256_slli_epi32, _mm256_set1_epi32, LOADW8)
+		v[0] = _mm256_add_epi32(v[0], a); v[1] = _mm256_add_epi32(v[1], b);
+		v[2] = _mm256_add_epi32(v[2], c); v[3] = _mm256_add_epi32(v[3], d);
+		v[4] = _mm256_add_epi32(v[4], e); v[5] = _mm256_add_epi32(v[5], f);
+		v[6] = _mm256_add_epi32(v[6], g); v[7] = _mm256_add_epi32(v[7], h);
+		for (i = 0; i < 8; i++)
+			p[i] += 64;
+	}
+
+	for (i = 0; i < 8; i++) {
+		uint32 x[8];
+		int j;
+		_mm256_storeu_si256((__m256i*)x, v[i]);
+		for (j = 0; j < 8; j++)
+			state[j][i] = x[j];
+	}
+}
+
+#endif /* SHA256_X86 */
@@ -0,0 +1,49 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file sha256-x86.h
+ * @brief Internal use only. Hardware accelerated SHA-256 compression functions.
+ */
+
+#ifndef __sha256_x86_h__
+#define __sha256_x86_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if !defined(SHA256_NO_X86) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define SHA256_X86
+#endif
+
+/* compresses blocks * 64 bytes of data into state */
+typedef void (*sha256_blocks_t)(unsigned int state[8], const unsigned char *data, unsigned int blocks);
+
+/* compresses blocks * 64 bytes of each data[i] into state[i], i < lanes of the kernel */
+typedef void (*sha256_blocks_mb_t)(unsigned int *state[], const unsigned char *data[], unsigned int blocks);
+
+#ifdef SHA256_X86
+void sha256_blocks_shani(unsigned int state[8], const unsigned char *data, unsigned int blocks);
+void sha256_blocks_avx2(unsigned int state[8], const unsigned char *data, unsigned int blocks);
+
+void sha256_blocks_x4_sse2(unsigned int *state[4], const unsigned char *data[4], unsigned int blocks);
+void sha256_blocks_x8_avx2(unsigned int *state[8], const unsigned char *data[8], unsigned int blocks);
+
+#define SHA256_CPU_SHANI 1 /* SHA extensions, SSSE3 and SSE4.1 */
+#define SHA256_CPU_AVX2  2 /* AVX2 and BMI2 enabled by the OS */
+#define SHA256_CPU_SSE2  4
+
+int sha256_cpu_features();
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __sha256_x86_h__ */
@@ -20,6 +20,7 @@
 
 #include <string.h>
 #include "sc-hsm-ultralite.h"
+#include "sha256-x86.h"
 
 typedef unsigned char uint8;
 typedef unsigned int uint32;
@@ -186,12 +187,87 @@ void sha256_process( sha256_context *ctx, uint8 data[64] )
     ctx->state[7] += H;
 }
 
+static void sha256_blocks_c( uint32 state[8], const uint8 *data, uint32 blocks )
+{
+    sha256_context ctx;
+
+    memcpy( ctx.state, state, sizeof( ctx.state ) );
+    for( ; blocks > 0; blocks--, data += 64 )
+        sha256_process( &ctx, (uint8 *) data );
+    memcpy( state, ctx.state, sizeof( ctx.state ) );
+}
+
+/*
+ * Compression functions of a CPU: one for bulk data and the
+ * multi-buffer one for sha256_update_mb with the number of lanes it
+ * advances per call, 0 if there is none.
+ */
+typedef struct
+{
+    sha256_blocks_t blocks;
+    sha256_blocks_mb_t blocks_mb;
+    int lanes;
+}
+sha256_impl_t;
+
+static const sha256_impl_t sha256_impl_c = { sha256_blocks_c, 0, 0 };
+#ifdef SHA256_X86
+static const sha256_impl_t sha256_impl_shani = { sha256_blocks_shani, 0, 0 };
+static const sha256_impl_t sha256_impl_avx2 = { sha256_blocks_avx2, sha256_blocks_x8_avx2, 8 };
+static const sha256_impl_t sha256_impl_sse2 = { sha256_blocks_c, sha256_blocks_x4_sse2, 4 };
+#endif
+
+/*
+ * Implementation selected on first use from the CPU features (SHA
+ * extensions, else AVX2, else portable C). The pointer is the only
+ * state written, with a release store read by an acquire load, so
+ * threads hashing from the start see a complete selection. Concurrent
+ * first calls store the same value, so no locking is required.
+ */
+static const sha256_impl_t *sha256_impl;
+
+#if defined(__ATOMIC_ACQUIRE)
+#define SHA256_LOAD_IMPL()    __atomic_load_n( &sha256_impl, __ATOMIC_ACQUIRE )
+#define SHA256_STORE_IMPL(p)  __atomic_store_n( &sha256_impl, (p), __ATOMIC_RELEASE )
+#else
+/* volatile accesses acquire and release with MSVC on x86 and x64 */
+#define SHA256_LOAD_IMPL()    ( *(const sha256_impl_t * volatile *) &sha256_impl )
+#define SHA256_STORE_IMPL(p)  ( *(const sha256_impl_t * volatile *) &sha256_impl = (p) )
+#endif
+
+static const sha256_impl_t *sha256_select( void )
+{
+    const sha256_impl_t *impl = SHA256_LOAD_IMPL();
+
+    if( impl )
+        return impl;
+    impl = &sha256_impl_c;
+#ifdef SHA256_X86
+    {
+        int features = sha256_cpu_features();
+
+        /* a single SHA extensions stream outruns eight AVX2 lanes */
+        if( features & SHA256_CPU_SHANI )
+            impl = &sha256_impl_shani;
+        else if( features & SHA256_CPU_AVX2 )
+            impl = &sha256_impl_avx2;
+        else if( features & SHA256_CPU_SSE2 )
+            impl = &sha256_impl_sse2;
+    }
+#endif
+    SHA256_STORE_IMPL( impl );
+    return impl;
+}
+
 void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
 {
+    const sha256_impl_t *impl;
     uint32 left, fill;
 
     if( ! length ) return;
 
+    impl = sha256_select();
+
     left = ctx->total[0] & 0x3F;
     fill = 64 - left;
 
@@ -205,17 +281,17 @@ void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
     {
         memcpy( (void *) (ctx->buffer + left),
                 (void *) input, fill );
-        sha256_process( ctx, ctx->buffer );
+        impl->blocks( ctx->state, ctx->buffer, 1 );
         length -= fill;
         input  += fill;
         left = 0;
     }
 
-    while( length >= 64 )
+    if( length >= 64 )
     {
-        sha256_process( ctx, input );
-        length -= 64;
-        input  += 64;
+        impl->blocks( ctx->state, input, length / 64 );
+        input  += length & ~0x3F;
+        length &= 0x3F;
     }
 
     if( length )
@@ -261,3 +337,146 @@ void sha256_finish( sha256_context *ctx, uint8 digest[32] )
     PUT_UINT32( ctx->state[6], digest, 24 );
     PUT_UINT32( ctx->state[7], digest, 28 );
 }
+
+/*
+ * Advance n independent contexts, ctx[i] by length[i] bytes of input[i].
+ * Complete blocks of up to the lanes of the CPU are compressed together
+ * in the SIMD lanes; partial blocks go through sha256_update.
+ */
+void sha256_update_mb( sha256_context *ctx[], uint8 *input[],
+                       uint32 length[], int n )
+{
+    uint32 *state[SHA256_MB_LANES], scratch[8];
+    const uint8 *data[SHA256_MB_LANES], *p[SHA256_MB_LANES];
+    uint32 blocks[SHA256_MB_LANES], head, bytes, common;
+    int base, m, i, j, lane[SHA256_MB_LANES];
+    const sha256_impl_t *impl = sha256_select();
+
+    for( base = 0; base < n; base += SHA256_MB_LANES )
+    {
+        m = n - base < SHA256_MB_LANES ? n - base : SHA256_MB_LANES;
+
+        for( i = 0; i < m; i++ )
+        {
+            sha256_context *c = ctx[base + i];
+            uint32 left = c->total[0] & 0x3F;
+
+            /* complete a partially filled block the usual way */
+            head = left ? 64 - left : 0;
+            if( head > length[base + i] )
+                head = length[base + i];
+            sha256_update( c, input[base + i], head );
+
+            blocks[i] = ( length[base + i] - head ) / 64;
+            p[i] = input[base + i] + head;
+
+            bytes = blocks[i] * 64;
+            c->total[0] += bytes;
+            if( c->total[0] < bytes )
+                c->total[1]++;
+        }
+
+        for( ;; )
+        {
+            /* lanes with complete blocks left */
+            for( i = j = 0; i < m; i++ )
+                if( blocks[i] )
+                    lane[j++] = i;
+            if( j == 0 )
+                break;
+
+            if( j < 2 || ! impl->lanes )
+            {
+                for( i = 0; i < j; i++ )
+                {
+                    impl->blocks( ctx[base + lane[i]]->state, p[lane[i]],
+                                  blocks[lane[i]] );
+                    p[lane[i]] += blocks[lane[i]] * 64;
+                    blocks[lane[i]] = 0;
+                }
+                continue;
+            }
+
+            if( j > impl->lanes )
+                j = impl->lanes;
+            common = blocks[lane[0]];
+            for( i = 0; i < j; i++ )
+            {
+                state[i] = ctx[base + lane[i]]->state;
+                data[i] = p[lane[i]];
+                if( blocks[lane[i]] < common )
+                    common = blocks[lane[i]];
+            }
+            /* idle lanes rehash the first input into a scratch state */
+            for( ; i < impl->lanes; i++ )
+            {
+                state[i] = scratch;
+                data[i] = data[0];
+            }
+
+            impl->blocks_mb( state, data, common );
+
+            for( i = 0; i < j; i++ )
+            {
+                p[lane[i]] += common * 64;
+                blocks[lane[i]] -= common;
+            }
+        }
+
+        for( i = 0; i < m; i++ )
+            sha256_update( ctx[base + i], (uint8 *) p[i],
+                           ( length[base + i] - ( p[i] - input[base + i] ) ) );
+    }
+}
+
+/*
+ * Finish n contexts at once, the digest of ctx[i] goes to digest[i].
+ */
+void sha256_finish_mb( sha256_context *ctx[], uint8 *digest[], int n )
+{
+    uint8 pad[SHA256_MB_LANES][72], *input[SHA256_MB_LANES];
+    uint32 length[SHA256_MB_LANES], last, padn;
+    uint32 high, low;
+    int base, m, i;
+
+    for( base = 0; base < n; base += SHA256_MB_LANES )
+    {
+        m = n - base < SHA256_MB_LANES ? n - base : SHA256_MB_LANES;
+
+        for( i = 0; i < m; i++ )
+        {
+            sha256_context *c = ctx[base + i];
+
+            high = ( c->total[0] >> 29 )
+                 | ( c->total[1] <<  3 );
+            low  = ( c->total[0] <<  3 );
+
+            last = c->total[0] & 0x3F;
+            padn = ( last < 56 ) ? ( 56 - last ) : ( 120 - last );
+
+            memcpy( pad[i], sha256_padding, padn );
+            PUT_UINT32( high, pad[i], padn );
+            PUT_UINT32( low,  pad[i], padn + 4 );
+
+            input[i] = pad[i];
+            length[i] = padn + 8;
+        }
+
+        sha256_update_mb( ctx + base, input, length, m );
+
+        for( i = 0; i < m; i++ )
+        {
+            sha256_context *c = ctx[base + i];
+            uint8 *d = digest[base + i];
+
+            PUT_UINT32( c->state[0], d,  0 );
+            PUT_UINT32( c->state[1], d,  4 );
+            PUT_UINT32( c->state[2], d,  8 );
+            PUT_UINT32( c->state[3], d, 12 );
+            PUT_UINT32( c->state[4], d, 16 );
+            PUT_UINT32( c->state[5], d, 20 );
+            PUT_UINT32( c->state[6], d, 24 );
+            PUT_UINT32( c->state[7], d, 28 );
+        }
+    }
+}
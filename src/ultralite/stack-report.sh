@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# SmartCard-HSM Ultra-Light Library
+#
+# Worst-case stack and heap use of the public functions, computed from the
+# call graph files (.ci) of gcc -fcallgraph-info=su, see "make report".
+#
+# usage: stack-report.sh sc-hsm-ultralite.h file.ci...
+#
+# stack : bytes of the deepest call chain within the library, calls of
+#         external functions (C library, PCSC, CT-API) count as 0
+# heap  : "arena" if the function may allocate with ul_malloc (malloc
+#         unless UL_ARENA), the peak is reported by ul_arena_usage
+# notes : "recursive" if a call chain returns into itself (the depth is
+#         that of one pass), "unbounded" for stack frames of dynamic size,
+#         "indirect" for calls through function pointers
+#
+
+if [ $# -lt 2 ]; then
+	echo "usage: $0 sc-hsm-ultralite.h file.ci..." >&2
+	exit 1
+fi
+
+header=$1
+shift
+
+sed -n 's/.*EXPORT_FUNC[ *]*\([a-z0-9_]*\)(.*/\1/p' "$header" | sort -u > /tmp/ul-public.$$
+cat "$@" | awk -v public=/tmp/ul-public.$$ '
+function title(s) {
+	sub(/.*title: "/, "", s)
+	sub(/".*/, "", s)
+	return s
+}
+function field(s, name) {
+	sub(".*" name ": \"", "", s)
+	sub(/".*/, "", s)
+	return s
+}
+function depth(f,    i, n, d, best, callee) {
+	if (f in memo)
+		return memo[f]
+	if (f in active) {
+		recursive[root] = 1
+		return 0
+	}
+	if (f == "__indirect_call")
+		indirect[root] = 1
+	if (f == "ul_malloc" || f == "ul_calloc" || f == "malloc" || f == "calloc")
+		heap[root] = 1
+	if (!(f in frame))
+		return 0
+	if (unbounded[f])
+		dynamic[root] = 1
+	active[f] = 1
+	best = 0
+	n = ncallee[f]
+	for (i = 1; i <= n; i++) {
+		d = depth(callee_of[f, i])
+		if (d > best) {
+			best = d
+			deepest[f] = callee_of[f, i]
+		}
+	}
+	delete active[f]
+	memo[f] = frame[f] + best
+	return memo[f]
+}
+/^node:/ {
+	t = title($0)
+	if ($0 ~ /[0-9]+ bytes \(/) {
+		l = field($0, "label")
+		sub(/ bytes.*/, "", l)
+		sub(/.*\\n/, "", l)
+		frame[t] = l + 0
+		if ($0 ~ /\(dynamic\)/)
+			unbounded[t] = 1
+	}
+	next
+}
+/^edge:/ {
+	s = field($0, "sourcename")
+	d = field($0, "targetname")
+	if (!((s, d) in edge)) {
+		edge[s, d] = 1
+		callee_of[s, ++ncallee[s]] = d
+	}
+}
+END {
+	while ((getline f < public) > 0)
+		names[++count] = f
+	printf "%-28s %8s  %-5s  %s\n", "function", "stack", "heap", "deepest chain / notes"
+	for (i = 1; i <= count; i++) {
+		root = names[i]
+		if (!(root in frame))
+			continue
+		split("", memo)
+		split("", deepest)
+		stack = depth(root)
+		chain = root
+		for (f = root; f in deepest; f = deepest[f]) {
+			g = deepest[f]
+			sub(/.*:/, "", g)
+			chain = chain " > " g
+		}
+		extra = ""
+		if (recursive[root])
+			extra = extra " (recursive)"
+		if (dynamic[root])
+			extra = extra " (unbounded)"
+		if (indirect[root])
+			extra = extra " (indirect)"
+		printf "%-28s %8d  %-5s  %s%s\n", root, stack, heap[root] ? "arena" : "-", chain, extra
+	}
+}'
+rc=$?
+rm -f /tmp/ul-public.$$
+exit $rc
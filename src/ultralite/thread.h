@@ -0,0 +1,54 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file thread.h
+ * @brief Internal use only. Threads, locks and condition variables for Win32 and pthreads.
+ */
+
+#ifndef __thread_h__
+#define __thread_h__
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE THREAD_T;
+typedef CRITICAL_SECTION LOCK_T;
+typedef CONDITION_VARIABLE COND_T;
+#define THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN 0
+#define thread_start(t, func, arg) ((*(t) = CreateThread(0, 0, func, arg, 0, 0)) == 0)
+#define thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define lock_init(l) (InitializeCriticalSection(l), 0)
+#define lock_destroy(l) DeleteCriticalSection(l)
+#define lock_enter(l) EnterCriticalSection(l)
+#define lock_leave(l) LeaveCriticalSection(l)
+#define cond_init(c) (InitializeConditionVariable(c), 0)
+#define cond_destroy(c)
+#define cond_wait(c, l) SleepConditionVariableCS(c, l, INFINITE)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+typedef pthread_t THREAD_T;
+typedef pthread_mutex_t LOCK_T;
+typedef pthread_cond_t COND_T;
+#define THREAD_FUNC(name, arg) void *name(void *arg)
+#define THREAD_RETURN 0
+#define thread_start(t, func, arg) pthread_create(t, 0, func, arg)
+#define thread_join(t) pthread_join(t, 0)
+#define lock_init(l) pthread_mutex_init(l, 0)
+#define lock_destroy(l) pthread_mutex_destroy(l)
+#define lock_enter(l) pthread_mutex_lock(l)
+#define lock_leave(l) pthread_mutex_unlock(l)
+#define cond_init(c) pthread_cond_init(c, 0)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, l) pthread_cond_wait(c, l)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+#endif /* __thread_h__ */
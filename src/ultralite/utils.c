@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "log.h"
 #include "utils.h"
@@ -28,143 +29,721 @@
  *******************************************************************************
  ******************************************************************************/
 
+#ifdef _WIN32
+#include <windows.h>
+#define CompareAndSwap(p, o, n) (InterlockedCompareExchange(p, n, o) == (o))
+#define AtomicAdd(p, v) InterlockedExchangeAdd64((volatile LONGLONG*)(p), (LONGLONG)(v))
+#else
+#define CompareAndSwap(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+#define AtomicAdd(p, v) __sync_add_and_fetch(p, v)
+#endif
+
+/* APDU statistics of the process, see ul_get_stats */
+static ul_stats_t Stats;
+
+static const uint8 ATR[] = { /* expected (A)nswer (T)o (R)equest */
+	0x3B, 0xFE, 0x18, 0x00, 0x00, 0x81, 0x31, 0xFE,
+	0x45, 0x80, 0x31, 0x81, 0x54, 0x48, 0x53, 0x4D,
+	0x31, 0x73, 0x80, 0x21, 0x40, 0x81, 0x07, 0xFA
+};
+
+static int SetLimits(Card_t *card, const uint8 *atr, int atrLen, int maxInput);
+static int VerifyPin(Card_t *card, const char *pin);
+static int PinStatus(Card_t *card);
+static int SelectApplet(Card_t *card);
+
 #ifdef CTAPI /* via libusb */
 #include <ctccid/ctapi.h>
 
-static uint16 Ctn;
+#define MAXPORT 8 /* MAX_READER of ctccid */
+
+struct Card {
+	uint16 Ctn;
+	char ReaderName[16]; /* "CT-API <port>" */
+	int MaxCommand;      /* negotiated APDU data lengths, see SetLimits */
+	int MaxResponse;
+	uint8 *Buf;          /* APDU buffer of BufLen bytes */
+	int BufLen;
+};
+
+/*
+ *  Port states: a port with a card stays open after SC_Close. ctccid claims
+ *  the USB interface exclusively, so the card keeps its power, the selected
+ *  applet and the T=1 state until the next SC_Open of this process.
+ */
+#define PORT_UNKNOWN 0 /* not probed yet or closed by SC_Cleanup */
+#define PORT_NONE    1 /* no reader at the last probe, SC_Open skips it until SC_Cleanup */
+#define PORT_PARKED  2 /* open and initialized, not used by a Card_t */
+#define PORT_IN_USE  3 /* owned by a Card_t */
+
+static volatile long PortState[MAXPORT];
+static uint8 PortATR[MAXPORT][34]; /* ATR of the last REQUEST ICC */
+static int PortATRLen[MAXPORT];
+#define ClaimPort(i, state) CompareAndSwap(&PortState[i], state, PORT_IN_USE)
 
-/* used only for SC_Open */
-static int SC_Init()
+/* used only for SC_Open, resets the card */
+static int SC_Init(Card_t *card)
 {
 	uint8 dad = 1;   /* Reader */
 	uint8 sad = 2;   /* Host   */
 	uint8 buf[260];
 	uint16 len = sizeof(buf);
 	/* - REQUEST ICC */
-	int rc = CT_data(Ctn, &dad, &sad, 5, (uint8*)"\x20\x12\x00\x01\x00", &len, buf);
-	if (rc < 0 || buf[0] == 0x64 || buf[0] == 0x62)
+	int rc = CT_data(card->Ctn, &dad, &sad, 5, (uint8*)"\x20\x12\x00\x01\x00", &len, buf);
+	if (rc < 0 || len < 2 || buf[0] == 0x64 || buf[0] == 0x62)
 		return ERR_CARD;
+	/* the response is the ATR, kept for SC_Open of the parked port */
+	PortATRLen[card->Ctn] = len - 2 < sizeof(PortATR[0]) ? len - 2 : sizeof(PortATR[0]);
+	memcpy(PortATR[card->Ctn], buf, PortATRLen[card->Ctn]);
+	/* the buffer of CT_data limits the APDU length */
+	if (SetLimits(card, buf, len - 2, 0xFFFF) < 0)
+		return ERR_MEMORY;
 	return buf[len - 1] == 0x00 ? 1 : 2;  /* Memory or processor card ? */
 }
 
-#define MAXPORT 2
+/*
+ *  Returns the ICC status of the port without touching the card,
+ *  0x05 is card in and powered, or error if < 0
+ */
+static int GetICCStatus(uint16 ctn)
+{
+	uint8 dad = 1;   /* Reader */
+	uint8 sad = 2;   /* Host   */
+	uint8 buf[16];
+	uint16 len = sizeof(buf);
+	/* - GET STATUS (ICC Status DO) */
+	int rc = CT_data(ctn, &dad, &sad, 5, (uint8*)"\x20\x13\x00\x80\x00", &len, buf);
+	if (rc < 0)
+		return ERR_CT;
+	if (len < 3 || buf[0] != 0x80)
+		return ERR_CT;
+	return buf[2];
+}
 
-int SC_Open(const char *pin, const char *reader)
+/*
+ *  Attaches card to the claimed port i. A powered card, parked or left by
+ *  another process with the PIN verified, needs no REQUEST ICC, the PIN
+ *  status is queried first. The PIN is verified in any case.
+ *
+ *  Returns : 0, ERR_PIN with the port still open, ERR_READER if the port
+ *            has no reader, or another error if < 0 with the port closed
+ */
+static int Attach(Card_t *card, uint16 i, const char *pin, int parked)
 {
 	int rc;
-	uint16 i;
-	/* find 1st available card */
-	for (i = 0; i < MAXPORT; i++) {
+	card->Ctn = i;
+	sprintf(card->ReaderName, "CT-API %d", i);
+	if (parked && GetICCStatus(i) == 0x05) {
+		if (SetLimits(card, PortATR[i], PortATRLen[i], 0xFFFF) < 0)
+			return ERR_MEMORY;
+		/* the applet is still selected */
+		rc = pin ? VerifyPin(card, pin) : 0;
+		if (rc == ERR_APDU) /* the card refused the pin */
+			return ERR_PIN;
+		if (rc >= 0)
+			return 0;
+		/* transmission failed, start over with a reset */
+	} else if (!parked) {
 		if (CT_init(i, i) < 0)
-			continue;
-		Ctn = i;
-		if (SC_Init() < 0) {
-			CT_close(i);
-			continue;
+			return ERR_READER;
+		/* without REQUEST ICC assume the ATR of a SmartCard-HSM, a card with a verified PIN is one */
+		if (PortATRLen[i] == 0) {
+			memcpy(PortATR[i], ATR, sizeof(ATR));
+			PortATRLen[i] = sizeof(ATR);
+		}
+		if (pin && GetICCStatus(i) == 0x05
+			&& SetLimits(card, PortATR[i], PortATRLen[i], 0xFFFF) == 0
+			&& PinStatus(card) == 0x9000) {
+			/* the applet is selected, the verification of the other process doesn't count */
+			rc = VerifyPin(card, pin);
+			if (rc == ERR_APDU)
+				return ERR_PIN;
+			if (rc >= 0)
+				return 0;
 		}
-		break;
 	}
-	if (Ctn == MAXPORT) {
-		log_err("no card found");
-		return ERR_CARD;
+	AtomicAdd(&Stats.resets, 1);
+	rc = SC_Init(card);
+	if (rc >= 0)
+		rc = SelectApplet(card);
+	if (rc >= 0 && pin) {
+		rc = VerifyPin(card, pin);
+		if (rc == ERR_APDU) /* the card refused the pin */
+			return ERR_PIN;
 	}
-	rc = SC_Logon(pin);
 	if (rc < 0) {
-		CT_close(Ctn);
-		return ERR_PIN;
+		CT_close(i);
+		return rc;
+	}
+	return 0;
+}
+
+int SC_Open(Card_t **ppCard, const char *pin, const char *reader)
+{
+	int rc = ERR_CARD, port = -1, pass, i;
+	Card_t *card;
+	*ppCard = 0;
+	/* reader "CT-API <port>" as listed by SC_ListTokens, other names select any port */
+	if (reader && sscanf(reader, "CT-API %d", &port) == 1 && (port < 0 || port >= MAXPORT)) {
+		log_err("no reader '%s'", reader);
+		return ERR_READER;
+	}
+	card = (Card_t*)ul_calloc(1, sizeof(Card_t));
+	if (card == 0)
+		return ERR_MEMORY;
+	/* 1st pass: parked ports, 2nd pass: probe the ports not open */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < MAXPORT; i++) {
+			if (port >= 0 && i != port)
+				continue;
+			if (pass == 0 ? !ClaimPort(i, PORT_PARKED) : !ClaimPort(i, PORT_UNKNOWN))
+				continue;
+			rc = Attach(card, i, pin, pass == 0);
+			if (rc == 0) {
+				AtomicAdd(&Stats.opens, 1);
+				*ppCard = card;
+				return 0;
+			}
+			if (rc == ERR_PIN) {
+				PortState[i] = PORT_PARKED;
+				ul_free(card->Buf);
+				ul_free(card);
+				return ERR_PIN;
+			}
+			/* a reader without a card is probed again, a card may be inserted */
+			PortState[i] = rc == ERR_READER ? PORT_NONE : PORT_UNKNOWN;
+		}
+	}
+	log_err("no card found");
+	ul_free(card->Buf);
+	ul_free(card);
+	return ERR_CARD;
+}
+
+/*
+ *  Closes the ports kept open by SC_Close, ports without a reader are probed
+ *  again by the next SC_Open
+ */
+void SC_Cleanup()
+{
+	int i;
+	for (i = 0; i < MAXPORT; i++)
+		if (ClaimPort(i, PORT_PARKED)) {
+			CT_close(i);
+			PortState[i] = PORT_UNKNOWN;
+		} else
+			CompareAndSwap(&PortState[i], PORT_NONE, PORT_UNKNOWN);
+}
+
+/*
+ *  Lists the ports with a reader not used by another Card_t as
+ *  "CT-API <port>\0...\0". Ports not open are only opened to see if the
+ *  reader exists, a REQUEST ICC would reset the card, so SC_Open finds out
+ *  if a token is present.
+ *
+ *  Returns : number of ports or error if < 0
+ */
+int SC_ListTokens(char *names, int namesLen)
+{
+	int i, n = 0, pos = 0;
+	if (namesLen < 1)
+		return ERR_MEMORY;
+	for (i = 0; i < MAXPORT && pos + 10 < namesLen; i++) {
+		if (ClaimPort(i, PORT_UNKNOWN) || ClaimPort(i, PORT_NONE)) {
+			int exists = CT_init(i, i) >= 0;
+			if (exists)
+				CT_close(i);
+			PortState[i] = exists ? PORT_UNKNOWN : PORT_NONE;
+			if (!exists) /* ctccid numbers the readers without gaps */
+				break;
+		}
+		if (PortState[i] == PORT_IN_USE)
+			continue;
+		pos += sprintf(names + pos, "CT-API %d", i) + 1;
+		n++;
 	}
+	names[pos] = 0;
+	return n;
+}
+
+/*
+ *  Check for a card event since the last call (or SC_Open)
+ *
+ *  Returns : 1 if the card was removed, reset or powered down, 0 if not, < 0 on error
+ */
+int SC_CardChanged(Card_t *card)
+{
+	int rc = GetICCStatus(card->Ctn);
+	if (rc < 0)
+		return rc;
+	/* 0x05: card in, CVCC on; anything else means the session is gone */
+	return rc != 0x05;
+}
+
+/*
+ *  Exclusive access, the port is owned by a single Card_t anyway
+ */
+int SC_Begin(Card_t *card)
+{
 	return 0;
 }
 
-int SC_Close()
+void SC_End(Card_t *card)
 {
-	return CT_close(Ctn);
+}
+
+/*
+ *  Returns the name of the reader of the card
+ */
+const char *SC_ReaderName(Card_t *card)
+{
+	return card->ReaderName;
+}
+
+int SC_Close(Card_t *card)
+{
+	if (card == 0)
+		return 0;
+	PortState[card->Ctn] = PORT_PARKED; /* keep open for the next SC_Open */
+	ul_free(card->Buf);
+	ul_free(card);
+	return 0;
 }
 
 #else /* via PCSC */
 #ifndef _WIN32
 #include <pcsclite.h>
+#include <reader.h>
 #endif
 #include <winscard.h>
 
-static SCARDCONTEXT hContext;
-static SCARDHANDLE hCard;
+struct Card {
+	SCARDCONTEXT hContext;
+	SCARDHANDLE hCard;
+	DWORD EventState; /* reader state of the last SC_CardChanged */
+	char ReaderName[128];
+	char *Pin;        /* to log on again after a reset by another process */
+	int Reconnecting; /* no nested reconnect from SC_Logon */
+	int MaxCommand;   /* negotiated APDU data lengths, see SetLimits */
+	int MaxResponse;
+	uint8 *Buf;       /* APDU buffer of BufLen bytes */
+	int BufLen;
+};
+
+/* transmit errors of readers which cannot pass an extended APDU, mapped to ERR_TRANS by Transmit */
+#define PCSC_LENGTH_ERROR(rc) ((rc) == SCARD_E_NOT_TRANSACTED || (rc) == SCARD_E_INSUFFICIENT_BUFFER)
+#define LENGTH_ERROR(rc) ((rc) == ERR_TRANS)
+
+#define CCID_HEADER 10 /* bytes of a CCID message before the APDU */
+
+/*
+ *  Returns the maximum APDU length the reader (CCID) passes, i.e. its
+ *  maximum message length without the CCID header, 0 if unknown
+ */
+static int GetMaxInput(Card_t *card)
+{
+#ifdef SCARD_ATTR_MAXINPUT
+	BYTE attr[4];
+	DWORD attrLen = sizeof(attr);
+	if (SCardGetAttrib(card->hCard, SCARD_ATTR_MAXINPUT, attr, &attrLen) == SCARD_S_SUCCESS && attrLen == 4) {
+		int maxInput = attr[0] | attr[1] << 8 | attr[2] << 16 | attr[3] << 24;
+		return maxInput > CCID_HEADER ? maxInput - CCID_HEADER : 0;
+	}
+#endif
+	return 0;
+}
+
+/* state bits which indicate a card change, the upper 16 bits are the event counter */
+#define EVENT_MASK (0xFFFF0000 | SCARD_STATE_PRESENT | SCARD_STATE_EMPTY | SCARD_STATE_MUTE | SCARD_STATE_UNAVAILABLE)
+
+static LONG GetReaderState(Card_t *card, DWORD *pState)
+{
+	SCARD_READERSTATE rs;
+	LONG rc;
+	memset(&rs, 0, sizeof(rs));
+	rs.szReader = card->ReaderName;
+	rs.dwCurrentState = *pState;
+	rc = SCardGetStatusChange(card->hContext, 0, &rs, 1);
+	if (rc == SCARD_S_SUCCESS)
+		*pState = rs.dwEventState & ~SCARD_STATE_CHANGED;
+	return rc;
+}
 
-int SC_Open(const char *pin, const char* reader)
+/* returns 1 if the connected card is a SmartCard-HSM */
+static int IsSmartCardHSM(SCARDHANDLE hCard)
+{
+	DWORD name_len = 0;
+	DWORD state, proto;
+	BYTE atr[sizeof(ATR)];
+	DWORD atr_len = sizeof(atr);
+	LONG rc = SCardStatus(hCard, NULL, &name_len, &state, &proto, atr, &atr_len);
+	return rc == SCARD_S_SUCCESS && atr_len == sizeof(ATR) && memcmp(atr, ATR, sizeof(ATR)) == 0;
+}
+
+int SC_Open(Card_t **ppCard, const char *pin, const char* reader)
 {
 	int rc, len, found;
 	LPSTR readerNames, readerName;
 	DWORD readersLen;
-	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+	Card_t *card;
+	*ppCard = 0;
+	card = (Card_t*)ul_calloc(1, sizeof(Card_t));
+	if (card == 0)
+		return ERR_MEMORY;
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &card->hContext);
 	if (rc != SCARD_S_SUCCESS) {
 		log_err("could not establish pcsc context");
+		ul_free(card);
 		return ERR_CONTEXT;
 	}
 	readersLen = SCARD_AUTOALLOCATE;
-	rc = SCardListReaders(hContext, 0, (LPTSTR)&readerNames, &readersLen);
+	rc = SCardListReaders(card->hContext, 0, (LPTSTR)&readerNames, &readersLen);
 	if (rc != SCARD_S_SUCCESS) {
 		log_err("no reader found");
-		rc = SCardReleaseContext(hContext);
+		rc = SCardReleaseContext(card->hContext);
+		ul_free(card);
 		return ERR_READER;
 	}
 	found = 0;
 	for (readerName = readerNames; readerName[0] != 0; readerName += len) {
 		DWORD proto;
 		len = strlen(readerName) + 1;
-		rc = SCardConnect(hContext, readerName, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &proto);
+		rc = SCardConnect(card->hContext, readerName, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &card->hCard, &proto);
 		if (rc == SCARD_S_SUCCESS) {
 			if (reader == 0 || strcmp(reader, readerName) == 0) {
-				static BYTE ATR[] = { /* expected (A)nswer (T)o (R)equest */
-					0x3B, 0xFE, 0x18, 0x00, 0x00, 0x81, 0x31, 0xFE,
-					0x45, 0x80, 0x31, 0x81, 0x54, 0x48, 0x53, 0x4D,
-					0x31, 0x73, 0x80, 0x21, 0x40, 0x81, 0x07, 0xFA
-				};
-				DWORD name_len = 0;
-				DWORD state;
-				LPBYTE atr[24];
-				DWORD atr_len = sizeof(atr);
-				rc = SCardStatus(hCard, NULL, &name_len, &state, &proto, (LPBYTE)&atr, &atr_len);
-				if (rc == SCARD_S_SUCCESS && atr_len == sizeof(ATR) && memcmp(atr, ATR, sizeof(ATR)) == 0) {
+				if (IsSmartCardHSM(card->hCard) && len <= sizeof(card->ReaderName)) {
+					memcpy(card->ReaderName, readerName, len);
 					found = 1;
 					break;
 				}
 			}
-			SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+			SCardDisconnect(card->hCard, SCARD_LEAVE_CARD);
 		}
 	}
-	SCardFreeMemory(hContext, readerNames);
+	SCardFreeMemory(card->hContext, readerNames);
 	if (!found) {
 		log_err("no card found");
-		SC_Close();
+		card->hCard = 0;
+		SC_Close(card);
 		return ERR_CARD;
 	}
-	rc = SC_Logon(pin);
+	if (SetLimits(card, ATR, sizeof(ATR), GetMaxInput(card)) < 0) {
+		SC_Close(card);
+		return ERR_MEMORY;
+	}
+	if (pin) {
+		card->Pin = (char*)ul_malloc(strlen(pin) + 1);
+		if (card->Pin == 0) {
+			SC_Close(card);
+			return ERR_MEMORY;
+		}
+		strcpy(card->Pin, pin);
+	}
+	rc = SelectApplet(card);
+	if (rc >= 0 && pin) {
+		rc = VerifyPin(card, pin);
+		if (rc == ERR_APDU) /* the card refused the pin */
+			rc = ERR_PIN;
+	}
 	if (rc < 0) {
-		SC_Close();
-		return ERR_PIN;
+		SC_Close(card);
+		return rc;
 	}
+	card->EventState = SCARD_STATE_UNAWARE;
+	GetReaderState(card, &card->EventState);
+	AtomicAdd(&Stats.opens, 1);
+	*ppCard = card;
 	return 0;
 }
 
-int SC_Close()
+/*
+ *  Lists the readers holding a SmartCard-HSM as "name\0name\0\0" in names
+ *
+ *  Returns : number of readers or error if < 0
+ */
+int SC_ListTokens(char *names, int namesLen)
+{
+	SCARDCONTEXT hContext;
+	SCARDHANDLE hCard;
+	LPSTR readerNames, readerName;
+	DWORD readersLen, proto;
+	int rc, len, n = 0, pos = 0;
+	if (namesLen < 1)
+		return ERR_MEMORY;
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+	if (rc != SCARD_S_SUCCESS) {
+		log_err("could not establish pcsc context");
+		return ERR_CONTEXT;
+	}
+	readersLen = SCARD_AUTOALLOCATE;
+	rc = SCardListReaders(hContext, 0, (LPTSTR)&readerNames, &readersLen);
+	if (rc != SCARD_S_SUCCESS) {
+		SCardReleaseContext(hContext);
+		return 0;
+	}
+	for (readerName = readerNames; readerName[0] != 0; readerName += len) {
+		len = strlen(readerName) + 1;
+		if (SCardConnect(hContext, readerName, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &proto) != SCARD_S_SUCCESS)
+			continue;
+		if (IsSmartCardHSM(hCard) && pos + len < namesLen) {
+			memcpy(names + pos, readerName, len);
+			pos += len;
+			n++;
+		}
+		SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+	}
+	names[pos] = 0;
+	SCardFreeMemory(hContext, readerNames);
+	SCardReleaseContext(hContext);
+	return n;
+}
+
+/*
+ *  Check for a card event since the last call (or SC_Open)
+ *
+ *  Returns : 1 if the reader reported a card event, 0 if not, < 0 on error
+ */
+int SC_CardChanged(Card_t *card)
+{
+	DWORD state = card->EventState;
+	LONG rc = GetReaderState(card, &state);
+	if (rc == SCARD_E_TIMEOUT)
+		return 0;
+	if (rc != SCARD_S_SUCCESS)
+		return ERR_READER;
+	rc = (state & EVENT_MASK) != (card->EventState & EVENT_MASK);
+	card->EventState = state;
+	return (int)rc;
+}
+
+/*
+ *  Logon after Reconnect. SC_Open verified the PIN of card, so if another
+ *  process verified it again since the reset, SELECT and VERIFY are skipped.
+ *  This saves two APDUs and leaves the PIN retry counter alone.
+ */
+static int Resume(Card_t *card)
+{
+	if (card->Pin && PinStatus(card) == 0x9000)
+		return 0;
+	return SC_Logon(card, card->Pin);
+}
+
+/*
+ *  Reconnects after the card was reset by another process or the reader,
+ *  the reset lost the selected applet and the verified PIN
+ */
+static int Reconnect(Card_t *card)
+{
+	DWORD proto;
+	int rc;
+	if (card->Reconnecting)
+		return ERR_CARD;
+	AtomicAdd(&Stats.resets, 1);
+	rc = SCardReconnect(card->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &proto);
+	if (rc != SCARD_S_SUCCESS) {
+		log_err("reconnect returned 0x%x", rc);
+		return ERR_CARD;
+	}
+	card->Reconnecting = 1;
+	rc = Resume(card);
+	card->Reconnecting = 0;
+	return rc < 0 ? ERR_PIN : 0;
+}
+
+/*
+ *  Start exclusive access to the card, reconnecting if it was reset
+ *  since the last access. End with SC_End.
+ *
+ *  Returns : 0 or error if < 0
+ */
+int SC_Begin(Card_t *card)
+{
+	LONG rc = SCardBeginTransaction(card->hCard);
+	if (rc == SCARD_W_RESET_CARD) {
+		rc = Reconnect(card);
+		if (rc < 0)
+			return (int)rc;
+		rc = SCardBeginTransaction(card->hCard);
+	}
+	if (rc != SCARD_S_SUCCESS) {
+		log_err("begin transaction returned 0x%x", rc);
+		return ERR_CARD;
+	}
+	return 0;
+}
+
+void SC_End(Card_t *card)
+{
+	SCardEndTransaction(card->hCard, SCARD_LEAVE_CARD);
+}
+
+/*
+ *  Returns the name of the reader of the card
+ */
+const char *SC_ReaderName(Card_t *card)
+{
+	return card->ReaderName;
+}
+
+int SC_Close(Card_t *card)
 {
 	int rc;
-	rc = SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-	hCard = 0;
-	rc = SCardReleaseContext(hContext);
-	hContext = 0;
+	if (card == 0)
+		return 0;
+	if (card->hCard)
+		rc = SCardDisconnect(card->hCard, SCARD_LEAVE_CARD);
+	rc = SCardReleaseContext(card->hContext);
+	if (card->Pin) {
+		memset(card->Pin, 0, strlen(card->Pin));
+		ul_free(card->Pin);
+	}
+	ul_free(card->Buf);
+	ul_free(card);
 	return rc;
 }
 
+/*
+ *  Nothing kept open, PCSC manages the readers
+ */
+void SC_Cleanup()
+{
+}
+
 #endif /* !CTAPI */
 
-int SC_Logon(const char *pin)
+#ifndef LENGTH_ERROR
+#define LENGTH_ERROR(rc) 0
+#endif
+
+/*
+ *  Returns 1 if the ATR announces extended Lc and Le fields, i.e. the 3rd
+ *  software function table byte of the card capabilities (ISO 7816-4)
+ */
+static int AtrExtendedLength(const uint8 *atr, int atrLen)
 {
-	uint16 sw1sw2;
-	int rc, pinLen;
+	int i, n, y, k, end;
+	if (atrLen < 2)
+		return 0;
+	k = atr[1] & 0x0F; /* number of historical bytes */
+	y = atr[1] >> 4;
+	for (i = 2; ; ) {  /* skip the interface bytes TAi, TBi, TCi, TDi */
+		n = !!(y & 1) + !!(y & 2) + !!(y & 4);
+		if (!(y & 8)) {
+			i += n;
+			break;
+		}
+		if (i + n >= atrLen)
+			return 0;
+		y = atr[i + n] >> 4;
+		i += n + 1;
+	}
+	end = i + k;
+	if (end > atrLen || k == 0 || atr[i] != 0x80) /* compact-TLV only */
+		return 0;
+	for (i++; i < end; i += 1 + (atr[i] & 0x0F))
+		if ((atr[i] & 0xF0) == 0x70 && (atr[i] & 0x0F) >= 3 && i + 3 < end)
+			return (atr[i + 3] & 0x40) != 0;
+	return 0;
+}
+
+/*
+ *  Negotiated limits per reader, these live as long as the process,
+ *  so reopening the token after an error does not probe again
+ */
+#define LIMITS_CACHE_SIZE 8
+
+static struct {
+	char Reader[128];
+	int MaxCommand;
+	int MaxResponse;
+} LimitsCache[LIMITS_CACHE_SIZE];
+static int LimitsCacheNext;
+static volatile long LimitsLock;
+
+#define LockLimits()   while (!CompareAndSwap(&LimitsLock, 0, 1))
+#define UnlockLimits() (LimitsLock = 0)
+
+/* updates or adds the entry of the reader, cached values are never raised */
+static void CacheLimits(Card_t *card)
+{
+	int i;
+	LockLimits();
+	for (i = 0; i < LIMITS_CACHE_SIZE; i++)
+		if (strcmp(LimitsCache[i].Reader, card->ReaderName) == 0)
+			break;
+	if (i == LIMITS_CACHE_SIZE) {
+		i = LimitsCacheNext;
+		LimitsCacheNext = (i + 1) % LIMITS_CACHE_SIZE;
+		strcpy(LimitsCache[i].Reader, card->ReaderName);
+	} else {
+		if (card->MaxCommand > LimitsCache[i].MaxCommand)
+			card->MaxCommand = LimitsCache[i].MaxCommand;
+		if (card->MaxResponse > LimitsCache[i].MaxResponse)
+			card->MaxResponse = LimitsCache[i].MaxResponse;
+	}
+	LimitsCache[i].MaxCommand = card->MaxCommand;
+	LimitsCache[i].MaxResponse = card->MaxResponse;
+	UnlockLimits();
+}
 
-	/* - SmartCard-HSM: SELECT APPLICATION */
-	rc = SC_ProcessAPDU(
+/*
+ *  Sets the APDU data lengths from the ATR of the card and the maximum
+ *  message length of the reader (0 if unknown), bounded by MAX_APDU_DATA
+ *  and by the cached limits of the reader, and allocates the APDU buffer
+ *
+ *  Returns : 0 or error if < 0
+ */
+static int SetLimits(Card_t *card, const uint8 *atr, int atrLen, int maxInput)
+{
+	int maxCommand = 255, maxResponse = 256;
+	if (AtrExtendedLength(atr, atrLen)) {
+		maxCommand = 65535;
+		maxResponse = 65536;
+		if (maxInput > 0) {
+			if (maxCommand > maxInput - 4 - 3 - 2) /* header, Lc and Le */
+				maxCommand = maxInput - 4 - 3 - 2;
+			if (maxResponse > maxInput - 2)        /* sw1sw2 */
+				maxResponse = maxInput - 2;
+		}
+	}
+	if (maxCommand > MAX_APDU_DATA)
+		maxCommand = MAX_APDU_DATA;
+	if (maxResponse > MAX_APDU_DATA)
+		maxResponse = MAX_APDU_DATA;
+	if (maxCommand < 255)
+		maxCommand = 255;
+	if (maxResponse < 256)
+		maxResponse = 256;
+	card->MaxCommand = maxCommand;
+	card->MaxResponse = maxResponse;
+	CacheLimits(card);
+	card->BufLen = 4 + 3 + card->MaxCommand + 2;
+	if (card->BufLen < card->MaxResponse + 2)
+		card->BufLen = card->MaxResponse + 2;
+	ul_free(card->Buf);
+	card->Buf = (uint8*)ul_malloc(card->BufLen);
+	return card->Buf ? 0 : ERR_MEMORY;
+}
+
+/*
+ *  Lowers the limits after the card or reader refused an APDU of len
+ *  bytes, returns 0 if the limit is at the short APDU minimum already
+ */
+static int ReduceLimit(Card_t *card, int *pMax, int len, int min)
+{
+	if (len <= min)
+		return 0;
+	*pMax = len / 2 < min ? min : len / 2;
+	log_wrn("reader '%s' refused %d bytes, using %d", card->ReaderName, len, *pMax);
+	CacheLimits(card);
+	return 1;
+}
+
+/* - SmartCard-HSM: SELECT APPLICATION */
+static int SelectApplet(Card_t *card)
+{
+	uint16 sw1sw2;
+	int rc = SC_ProcessAPDU(card,
 		0, 0x00,0xA4,0x04,0x0C,
 		(uint8*)"\xE8\x2B\x06\x01\x04\x01\x81\xc3\x1f\x02\x01", 11,
 		NULL, 0,
@@ -177,12 +756,16 @@ int SC_Logon(const char *pin)
 		log_err("select applet returned 0x%x", sw1sw2);
 		return ERR_APDU;
 	}
+	return rc;
+}
 
-	if (pin == 0)
-		return rc;
+/* - SmartCard-HSM: VERIFY PIN, ERR_APDU if the card refused the pin */
+static int VerifyPin(Card_t *card, const char *pin)
+{
+	uint16 sw1sw2;
+	int rc, pinLen;
 	pinLen = strlen(pin);
-	/* - SmartCard-HSM: VERIFY PIN */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(card,
 		0, 0x00,0x20,0x00,0x81,
 		(uint8*)pin, pinLen,
 		NULL, 0,
@@ -211,70 +794,128 @@ int SC_Logon(const char *pin)
 	return rc;
 }
 
-int SC_ReadFile(uint16 fid, int off, uint8 *data, int dataLen)
+int SC_Logon(Card_t *card, const char *pin)
 {
-	uint16 sw1sw2;
-	int rc;
-	uint8 offset[4];
-	offset[0] = 0x54;
-	offset[1] = 0x02;
-	offset[2] = off >> 8;
-	offset[3] = off >> 0;
-	/* - SmartCard-HSM: READ BINARY */
-	rc = SC_ProcessAPDU(
-		0, 0x00,
-		0xB1,      /* READ BINARY */
-		fid >> 8,  /* MSB(fid) */
-		fid >> 0,  /* LSB(fid) */
-		offset, 4,
-		data, dataLen,
-		&sw1sw2);
-	if (rc < 0)
+	int rc = SelectApplet(card);
+	if (rc < 0 || pin == 0)
 		return rc;
-	if (sw1sw2 != 0x9000 && sw1sw2 != 0x6282)
-		return ERR_APDU;
-	return rc;
+	return VerifyPin(card, pin);
 }
 
-int SC_WriteFile(uint16 fid, int off, uint8 *data, int dataLen)
+/* PIN status (VERIFY without data), 0x9000 if the applet is selected and the PIN verified */
+static int PinStatus(Card_t *card)
 {
 	uint16 sw1sw2;
-	int rc;
-	uint8 buf[MAX_OUT_IN];
-	if (dataLen > MAX_OUT_IN - 6)
-		return ERR_MEMORY;
-	buf[0] = 0x54;
-	buf[1] = 0x02;
-	buf[2] = off >> 8;
-	buf[3] = off >> 0;
-	buf[4] = 0x53;
-	buf[5] = 0;
-	memcpy(buf + 6, data, dataLen);
-
-	/* - SmartCard-HSM: UPDATE BINARY */
-	rc = SC_ProcessAPDU(
-		0, 0x00,
-		0xD7,      /* UPDATE BINARY */
-		fid >> 8,  /* MSB(fid) */
-		fid >> 0,  /* LSB(fid) */
-		buf, 6 + dataLen,
+	int rc = SC_ProcessAPDU(card,
+		0, 0x00,0x20,0x00,0x81,
+		NULL, 0,
 		NULL, 0,
 		&sw1sw2);
-	if (rc < 0)
-		return rc;
-	if (sw1sw2 != 0x9000)
-		return ERR_APDU;
-	return rc;
+	return rc < 0 ? rc : sw1sw2;
+}
+
+/*
+ *  Reads dataLen bytes at off in as few APDUs as the negotiated limits allow
+ *
+ *  Returns : bytes read, less than dataLen at the end of file, or error if < 0
+ */
+int SC_ReadFile(Card_t *card, uint16 fid, int off, uint8 *data, int dataLen)
+{
+	uint16 sw1sw2;
+	int rc, len, done;
+	uint8 offset[4];
+	for (done = 0; done < dataLen; done += rc) {
+		len = dataLen - done;
+		if (len > card->MaxResponse)
+			len = card->MaxResponse;
+		offset[0] = 0x54;
+		offset[1] = 0x02;
+		offset[2] = (off + done) >> 8;
+		offset[3] = (off + done) >> 0;
+		/* - SmartCard-HSM: READ BINARY */
+		rc = SC_ProcessAPDU(card,
+			0, 0x00,
+			0xB1,      /* READ BINARY */
+			fid >> 8,  /* MSB(fid) */
+			fid >> 0,  /* LSB(fid) */
+			offset, 4,
+			data + done, len,
+			&sw1sw2);
+		if ((sw1sw2 == 0x6700 || rc < 0 && LENGTH_ERROR(rc))
+			&& ReduceLimit(card, &card->MaxResponse, len, 256)) {
+			rc = 0; /* repeat with the lower limit */
+			continue;
+		}
+		if (rc < 0)
+			return rc;
+		if (sw1sw2 != 0x9000 && sw1sw2 != 0x6282)
+			return ERR_APDU;
+		if (rc < len) {  /* end of file */
+			done += rc;
+			break;
+		}
+	}
+	return done;
 }
 
-int SC_Sign(uint8 op, uint8 keyFid,
+/*
+ *  Writes dataLen bytes at off in as few APDUs as the negotiated limits allow
+ *
+ *  Returns : 0 or error if < 0
+ */
+int SC_WriteFile(Card_t *card, uint16 fid, int off, uint8 *data, int dataLen)
+{
+	uint16 sw1sw2;
+	int rc, len, done;
+	uint8 *buf;
+	len = dataLen < card->MaxCommand - 6 ? dataLen : card->MaxCommand - 6;
+	buf = (uint8*)ul_malloc(6 + len);
+	if (buf == 0)
+		return ERR_MEMORY;
+	for (rc = done = 0; done < dataLen; ) {
+		len = dataLen - done;
+		if (len > card->MaxCommand - 6)
+			len = card->MaxCommand - 6;
+		buf[0] = 0x54;
+		buf[1] = 0x02;
+		buf[2] = (off + done) >> 8;
+		buf[3] = (off + done) >> 0;
+		buf[4] = 0x53;
+		buf[5] = 0;
+		memcpy(buf + 6, data + done, len);
+
+		/* - SmartCard-HSM: UPDATE BINARY */
+		rc = SC_ProcessAPDU(card,
+			0, 0x00,
+			0xD7,      /* UPDATE BINARY */
+			fid >> 8,  /* MSB(fid) */
+			fid >> 0,  /* LSB(fid) */
+			buf, 6 + len,
+			NULL, 0,
+			&sw1sw2);
+		if ((sw1sw2 == 0x6700 || rc < 0 && LENGTH_ERROR(rc))
+			&& ReduceLimit(card, &card->MaxCommand, 6 + len, 255))
+			continue;
+		if (rc < 0)
+			break;
+		if (sw1sw2 != 0x9000) {
+			rc = ERR_APDU;
+			break;
+		}
+		done += len;
+	}
+	ul_free(buf);
+	return rc < 0 ? rc : 0;
+}
+
+int SC_Sign(Card_t *card, uint8 op, uint8 keyFid,
 	uint8 *outBuf, int outLen,
 	uint8 *inBuf, int inSize)
 {
 	uint16 sw1sw2;
 	int rc;
 	/* - SmartCard-HSM: SIGN */
-	rc = SC_ProcessAPDU(
+	rc = SC_ProcessAPDU(card,
 		0, 0x80,
 		0x68, /* SIGN */
 		keyFid,
@@ -292,6 +933,7 @@ int SC_Sign(uint8 op, uint8 keyFid,
 /*
  *  Process an ISO 7816 APDU with the underlying terminal hardware.
  *
+ *  card    : Token connection returned by SC_Open
  *  cla     : Class byte of instruction
  *  ins     : Instruction byte
  *  p1      : Parameter P1
@@ -304,19 +946,73 @@ int SC_Sign(uint8 op, uint8 keyFid,
  *
  *  Returns : < 0 Error >= 0 Bytes read
  */
-int SC_ProcessAPDU(
+/* monotonic time in microseconds */
+static unsigned long long NowUs()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+/* adds an APDU to the statistics, a few atomic adds only */
+static void CountAPDU(uint8 ins, int outLen, int rc, uint16 sw1sw2, unsigned long long us)
+{
+	ul_ins_stats_t *s;
+	int i;
+	switch (ins) {
+	case 0xA4: s = &Stats.ins[UL_STATS_SELECT]; break;
+	case 0x20: s = &Stats.ins[UL_STATS_VERIFY]; break;
+	case 0xB1: s = &Stats.ins[UL_STATS_READ]; break;
+	case 0x68: s = &Stats.ins[UL_STATS_SIGN]; break;
+	case 0x58: s = &Stats.ins[UL_STATS_ENUMERATE]; break;
+	default:   s = &Stats.ins[UL_STATS_OTHER]; break;
+	}
+	AtomicAdd(&s->calls, 1);
+	if (rc < 0 || sw1sw2 != 0x9000 && sw1sw2 != 0x6282)
+		AtomicAdd(&s->errors, 1);
+	AtomicAdd(&s->bytes_out, outLen);
+	if (rc > 0)
+		AtomicAdd(&s->bytes_in, rc);
+	AtomicAdd(&s->time_us, us);
+	for (i = 0; us >= 2 && i < UL_STATS_BUCKETS - 1; us >>= 1)
+		i++;
+	AtomicAdd(&s->hist[i], 1);
+}
+
+void SC_GetStats(ul_stats_t *stats)
+{
+	*stats = Stats;
+}
+
+void SC_ResetStats()
+{
+	memset(&Stats, 0, sizeof(Stats));
+}
+
+static int Transmit(Card_t *card,
 	int todad,
 	uint8 cla, uint8 ins, uint8 p1, uint8 p2,
 	uint8 *outData, int outLen,
 	uint8 *inData, int inLen,
 	uint16 *sw1sw2)
 {
-	uint8 scr[4 + 5 + MAX_OUT_IN];
+	uint8 *scr = card->Buf;
 	int rc;
 #ifdef CTAPI
 	uint16 len;
 #else
+	LONG lrc;
 	DWORD len;
+	int retry;
 #endif
 	uint8 dad, sad;
 	uint8 *p;
@@ -325,8 +1021,8 @@ int SC_ProcessAPDU(
 	*sw1sw2 = 0x0000;
 
 	if (!scr
-		|| 4 + 5 + outLen > sizeof(scr)        /* worst case: long APDU and in and out */
-		|| inLen + 2 > sizeof(scr)             /* need space for sw1sw2 */
+		|| 4 + 5 + outLen > card->BufLen       /* worst case: long APDU and in and out */
+		|| inLen + 2 > card->BufLen            /* need space for sw1sw2 */
 		|| !(0 <= inLen  && inLen  <= 0x10000) /* crazy - invalid in length */
 		|| !(0 <= outLen && outLen <= 0x10000) /* crazy - invalid out length */
 		|| outLen > 0 && !outData              /* no out buffer */
@@ -334,6 +1030,10 @@ int SC_ProcessAPDU(
 	)
 		return ERR_MEMORY;
 
+#ifndef CTAPI
+	retry = 0;
+build:
+#endif
 	p = scr;
 	*p++ = cla;
 	*p++ = ins;
@@ -366,11 +1066,22 @@ int SC_ProcessAPDU(
 	}
 	sad = HOST;
 	dad = todad;
-	len = sizeof(scr);
+	len = card->BufLen;
 #ifdef CTAPI
-	rc = CT_data(Ctn, &dad, &sad, (unsigned short)(p - scr), scr, &len, scr);
+	rc = CT_data(card->Ctn, &dad, &sad, (unsigned short)(p - scr), scr, &len, scr);
 #else
-	rc = SCardTransmit(hCard, SCARD_PCI_T1, scr, (unsigned)(p - scr), 0, scr, &len);
+	/* LONG is 64 bit with pcsc-lite on LP64, compare before narrowing */
+	lrc = SCardTransmit(card->hCard, SCARD_PCI_T1, scr, (unsigned)(p - scr), 0, scr, &len);
+	if (lrc == SCARD_W_RESET_CARD && !retry && Reconnect(card) == 0) {
+		retry = 1; /* repeat once, the log on of Reconnect used the buffer */
+		goto build;
+	}
+	if (lrc != SCARD_S_SUCCESS) {
+		if (PCSC_LENGTH_ERROR(lrc))
+			return ERR_TRANS; /* see LENGTH_ERROR */
+		return (int)lrc < 0 ? (int)lrc : ERR_CARD;
+	}
+	rc = 0;
 #endif
 	if (rc < 0)
 		return rc;
@@ -387,3 +1098,15 @@ int SC_ProcessAPDU(
 	return rc;
 }
 
+int SC_ProcessAPDU(Card_t *card,
+	int todad,
+	uint8 cla, uint8 ins, uint8 p1, uint8 p2,
+	uint8 *outData, int outLen,
+	uint8 *inData, int inLen,
+	uint16 *sw1sw2)
+{
+	unsigned long long start = NowUs();
+	int rc = Transmit(card, todad, cla, ins, p1, p2, outData, outLen, inData, inLen, sw1sw2);
+	CountAPDU(ins, outLen, rc, *sw1sw2, NowUs() - start);
+	return rc;
+}
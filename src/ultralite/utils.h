@@ -16,10 +16,13 @@
 #ifndef __utils_h__
 #define __utils_h__
 
-#if defined(_WIN32) || defined(__linux__)
-#define MAX_OUT_IN 8192
-#else /* save stack space on systems with limited memory */
-#define MAX_OUT_IN 256
+#include "sc-hsm-ultralite.h"
+
+/* upper bound of the APDU data length negotiated with reader and card */
+#if (defined(_WIN32) || defined(__linux__)) && !defined(UL_ARENA)
+#define MAX_APDU_DATA 65536
+#else /* save heap space on systems with limited memory */
+#define MAX_APDU_DATA 256
 #endif
 
 typedef unsigned char uint8;
@@ -29,23 +32,45 @@ typedef unsigned short uint16;
 extern "C" {
 #endif
 
+/* connection to a token, opaque outside utils.c */
+typedef struct Card Card_t;
+
 /* utility functions */
 
-int SC_Open(const char *pin, const char *reader);
-int SC_Close();
-int SC_Logon(const char *pin);
-int SC_ReadFile(uint16 fid, int off, uint8 *data, int dataLen);
-int SC_WriteFile(uint16 fid, int off, uint8 *data, int dataLen);
-int SC_Sign(uint8 op, uint8 keyFid,
+int SC_Open(Card_t **ppCard, const char *pin, const char *reader);
+int SC_Close(Card_t *card);
+int SC_ListTokens(char *names, int namesLen);
+void SC_Cleanup();
+int SC_Logon(Card_t *card, const char *pin);
+int SC_CardChanged(Card_t *card);
+int SC_Begin(Card_t *card);
+void SC_End(Card_t *card);
+const char *SC_ReaderName(Card_t *card);
+int SC_ReadFile(Card_t *card, uint16 fid, int off, uint8 *data, int dataLen);
+int SC_WriteFile(Card_t *card, uint16 fid, int off, uint8 *data, int dataLen);
+int SC_Sign(Card_t *card, uint8 op, uint8 keyFid,
 	uint8 *outBuf, int outLen,
 	uint8 *inBuf, int inSize);
-int SC_ProcessAPDU(
+void SC_GetStats(ul_stats_t *stats);
+void SC_ResetStats();
+int SC_ProcessAPDU(Card_t *card,
 	int todad,
 	uint8 cla, uint8 ins, uint8 p1, uint8 p2,
 	uint8 *outData, int outLen,
 	uint8 *inData, int inLen,
 	uint16 *sw1sw2);
 
+/* heap of the library, the caller provided arena in the UL_ARENA profile */
+#ifdef UL_ARENA
+void *ul_malloc(size_t size);
+void *ul_calloc(size_t n, size_t size);
+void ul_free(void *p);
+#else
+#define ul_malloc malloc
+#define ul_calloc calloc
+#define ul_free free
+#endif
+
 #define SaveToFile(name, ptr, len) {\
 	FILE *f = fopen(name, "wb");\
 	if (f) {\